@@ -3,6 +3,7 @@
 
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <sys/types.h>
 #include <sys/uio.h>
@@ -18,9 +19,17 @@ Disk::Disk(string imageFile, int blockSize) {
   this->imageFile = imageFile;
   this->blockSize = blockSize;
   this->isInTransaction = false;
+  pthread_mutex_init(&this->cacheLock, NULL);
+  for (int i = 0; i < DISK_WRITE_LOCKS; i++) {
+    pthread_mutex_init(&this->writeLocks[i], NULL);
+  }
   
+  // images we can't write to can still be read, writes to them fail
   struct stat stat;
-  int imageFileDescriptor = open(imageFile.c_str(), O_RDONLY);
+  imageFileDescriptor = open(imageFile.c_str(), O_RDWR);
+  if (imageFileDescriptor < 0) {
+    imageFileDescriptor = open(imageFile.c_str(), O_RDONLY);
+  }
   if (imageFileDescriptor < 0) {
     cerr << "could not open " << imageFile << endl;
     exit(1);
@@ -30,7 +39,6 @@ Disk::Disk(string imageFile, int blockSize) {
     cerr << "Could not stat image file" << endl;
     exit(1);
   }
-  close(imageFileDescriptor);
   
   this->imageFileSize = stat.st_size;
 
@@ -49,32 +57,83 @@ int Disk::numberOfBlocks() {
 }
 
 void Disk::readBlock(int blockNumber, void *buffer) {
+  BlockBuffer block = getBlock(blockNumber);
+  memcpy(buffer, block.get(), this->blockSize);
+}
+
+BlockBuffer Disk::getBlock(int blockNumber) {
   if (blockNumber < 0 || blockNumber >= this->numberOfBlocks()) {
     cerr << "Invalid block number " << blockNumber << endl;
     exit(1);
   }
 
-  int fd = open(this->imageFile.c_str(), O_RDONLY);
-  if (fd < 0) {
-    cerr << "Could not open image file " << this->imageFile << endl;
-    exit(1);
+  pthread_mutex_lock(&cacheLock);
+  BlockBuffer block = findCached(blockNumber);
+  unsigned long generation = writeGeneration(blockNumber);
+  pthread_mutex_unlock(&cacheLock);
+  if (block) {
+    return block;
   }
 
-  int offset = blockNumber * this->blockSize;
-  int ret = lseek(fd, offset, SEEK_SET);
-  if (ret != offset) {
-    perror("read::lseek");
-    cerr << "Could not seek to file" << endl;
-    exit(1);
+  unsigned char *buffer = new unsigned char[this->blockSize];
+  block = BlockBuffer(buffer, default_delete<unsigned char[]>());
+  readImage(blockNumber, buffer);
+
+  // another thread may have cached it while we were reading, and if the
+  // block was written since we started what we read might already be stale
+  pthread_mutex_lock(&cacheLock);
+  BlockBuffer cached = findCached(blockNumber);
+  if (cached) {
+    block = cached;
+  } else if (generation == writeGeneration(blockNumber)) {
+    cacheBlock(blockNumber, block);
   }
+  pthread_mutex_unlock(&cacheLock);
+  return block;
+}
 
-  ret = read(fd, buffer, this->blockSize);
+void Disk::readImage(int blockNumber, unsigned char *buffer) {
+  off_t offset = (off_t) blockNumber * this->blockSize;
+  int ret = pread(imageFileDescriptor, buffer, this->blockSize, offset);
   if (ret != this->blockSize) {
+    perror("read::pread");
     cerr << "Could not read file" << endl;
     exit(1);
   }
+}
+
+unsigned long Disk::writeGeneration(int blockNumber) {
+  map<int, unsigned long>::iterator generation = writeGenerations.find(blockNumber);
+  return generation == writeGenerations.end() ? 0 : generation->second;
+}
+
+pthread_mutex_t *Disk::writeLock(int blockNumber) {
+  return &writeLocks[blockNumber % DISK_WRITE_LOCKS];
+}
+
+BlockBuffer Disk::findCached(int blockNumber) {
+  map<int, pair<BlockBuffer, list<int>::iterator> >::iterator cached = cache.find(blockNumber);
+  if (cached == cache.end()) {
+    return BlockBuffer();
+  }
+  cacheOrder.splice(cacheOrder.begin(), cacheOrder, cached->second.second);
+  return cached->second.first;
+}
+
+void Disk::cacheBlock(int blockNumber, BlockBuffer buffer) {
+  map<int, pair<BlockBuffer, list<int>::iterator> >::iterator cached = cache.find(blockNumber);
+  if (cached != cache.end()) {
+    cacheOrder.erase(cached->second.second);
+    cache.erase(cached);
+  }
+
+  cacheOrder.push_front(blockNumber);
+  cache[blockNumber] = make_pair(buffer, cacheOrder.begin());
 
-  close(fd);
+  if ((int) cache.size() > DISK_CACHE_BLOCKS) {
+    cache.erase(cacheOrder.back());
+    cacheOrder.pop_back();
+  }
 }
 
 void Disk::writeBlock(int blockNumber, void *buffer) {  
@@ -83,60 +142,90 @@ void Disk::writeBlock(int blockNumber, void *buffer) {
     exit(1);
   }
 
-  if (isInTransaction) {
-    struct UndoRecord undoRecord;
+  // Only the block's write lock is held while the image is written,
+  // cacheLock is just taken to look at and update the cache and undo log
+  pthread_mutex_lock(writeLock(blockNumber));
+  pthread_mutex_lock(&cacheLock);
+  bool inTransaction = isInTransaction;
+  BlockBuffer cached = findCached(blockNumber);
+  pthread_mutex_unlock(&cacheLock);
+
+  struct UndoRecord undoRecord;
+  if (inTransaction) {
     undoRecord.blockNumber = blockNumber;
     undoRecord.blockData = new unsigned char[blockSize];
-    this->readBlock(blockNumber, undoRecord.blockData);
-    undoLog.push_front(undoRecord);
-  }
-  
-  int fd = open(this->imageFile.c_str(), O_RDWR);
-  if (fd < 0) {
-    cerr << "Could not open image file " << this->imageFile << endl;
-    exit(1);
-  }
-
-  int offset = blockNumber * this->blockSize;
-  int ret = lseek(fd, offset, SEEK_SET);
-  if (ret != offset) {
-    perror("write::lseek");
-    cerr << "Could not seek to file" << endl;
-    exit(1);
+    if (cached) {
+      memcpy(undoRecord.blockData, cached.get(), blockSize);
+    } else {
+      readImage(blockNumber, undoRecord.blockData);
+    }
   }
 
-  ret = write(fd, buffer, this->blockSize);
+  off_t offset = (off_t) blockNumber * this->blockSize;
+  int ret = pwrite(imageFileDescriptor, buffer, this->blockSize, offset);
   if (ret != this->blockSize) {
+    perror("write::pwrite");
     cerr << "Could not write file" << endl;
     exit(1);
   }
-  fsync(fd);
-  close(fd);
+  // a transaction's writes are made durable all at once by commit
+  if (!inTransaction) {
+    fsync(imageFileDescriptor);
+  }
+
+  // Buffers handed out by getBlock are never modified, so cache a new copy
+  unsigned char *copy = new unsigned char[this->blockSize];
+  memcpy(copy, buffer, this->blockSize);
+  pthread_mutex_lock(&cacheLock);
+  if (inTransaction) {
+    undoLog.push_front(undoRecord);
+  }
+  writeGenerations[blockNumber]++;
+  cacheBlock(blockNumber, BlockBuffer(copy, default_delete<unsigned char[]>()));
+  pthread_mutex_unlock(&cacheLock);
+  pthread_mutex_unlock(writeLock(blockNumber));
 }
 
 void Disk::beginTransaction() {
+  pthread_mutex_lock(&cacheLock);
   if (isInTransaction) {
     cerr << "You can't start a new transaction: one already exists" << endl;
     exit(1);
   }
   isInTransaction = true;
+  pthread_mutex_unlock(&cacheLock);
 }
 
 void Disk::commit() {
+  pthread_mutex_lock(&cacheLock);
   isInTransaction = false;
+  deque<struct UndoRecord> records;
+  records.swap(undoLog);
+  pthread_mutex_unlock(&cacheLock);
+
+  if (!records.empty()) {
+    syncImage();
+  }
   deque<struct UndoRecord>::iterator iter;
-  for (iter = undoLog.begin(); iter != undoLog.end(); iter++) {
+  for (iter = records.begin(); iter != records.end(); iter++) {
     delete [] iter->blockData;
   }
-  undoLog.clear();
+}
+
+void Disk::syncImage() {
+  fsync(imageFileDescriptor);
 }
 
 void Disk::rollback() {
+  pthread_mutex_lock(&cacheLock);
   isInTransaction = false;
+  deque<struct UndoRecord> records;
+  records.swap(undoLog);
+  pthread_mutex_unlock(&cacheLock);
+
   deque<struct UndoRecord>::iterator iter;
-  for (iter = undoLog.begin(); iter != undoLog.end(); iter++) {
+  for (iter = records.begin(); iter != records.end(); iter++) {
     this->writeBlock(iter->blockNumber, iter->blockData);
     delete [] iter->blockData;
   }
-  undoLog.clear();
 }
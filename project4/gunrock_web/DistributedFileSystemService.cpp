@@ -1,32 +1,443 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
+#include <time.h>
 #include <sstream>
 #include <iostream>
 #include <map>
 #include <string>
 #include <algorithm>
+#include <vector>
 
 #include "DistributedFileSystemService.h"
 #include "ClientError.h"
 #include "ufs.h"
 #include "WwwFormEncodedDict.h"
+#include "StringUtils.h"
 
 using namespace std;
 
 DistributedFileSystemService::DistributedFileSystemService(string diskFile) : HttpService("/ds3/") {
-  this->fileSystem = new LocalFileSystem(new Disk(diskFile, UFS_BLOCK_SIZE));
+  mount(vector<string>(1, diskFile), false);
 }  
 
+DistributedFileSystemService::DistributedFileSystemService(vector<string> diskFiles, bool writeBack)
+  : HttpService("/ds3/") {
+  mount(diskFiles, writeBack);
+}
+
+void DistributedFileSystemService::mount(vector<string> diskFiles, bool writeBack) {
+  this->writeBack = writeBack;
+  for (size_t idx = 0; idx < diskFiles.size(); idx++) {
+    Volume *volume = new Volume();
+    volume->fileSystem = new LocalFileSystem(new Disk(diskFiles[idx], UFS_BLOCK_SIZE));
+    // A PUT buffers the object and allocates its blocks once its whole size
+    // is known, so they go in one run. With write back that happens later,
+    // and objects deleted before then never get blocks at all.
+    volume->fileSystem->setDelayedAllocation(true);
+    pthread_mutex_init(&volume->transactionLock, NULL);
+    volumes.push_back(volume);
+  }
+
+  // Entries on the wrong volume, say from images given in a different
+  // order, can't be reached, so say so instead of quietly hiding them
+  for (size_t idx = 0; idx < volumes.size(); idx++) {
+    vector<dir_ent_t> page;
+    long cookie = 0;
+    while (volumes[idx]->fileSystem->readdir(UFS_ROOT_DIRECTORY_INODE_NUMBER, page,
+                                             Geometry::entriesPerBlock, cookie) > 0) {
+      for (size_t entry = 0; entry < page.size(); entry++) {
+        string name = page[entry].name;
+        if (name != "." && name != ".." && volumeFor(name) != volumes[idx]) {
+          cerr << "warning: " << diskFiles[idx] << " has /" << name
+               << ", which belongs on another volume and can't be reached" << endl;
+        }
+      }
+    }
+  }
+
+  if (writeBack) {
+    pthread_create(&flusher, NULL, flushVolumes, this);
+  }
+}
+
+void *DistributedFileSystemService::flushVolumes(void *service) {
+  vector<Volume *> &volumes = static_cast<DistributedFileSystemService *>(service)->volumes;
+  while (true) {
+    sleep(FLUSH_INTERVAL_SECONDS);
+    for (size_t idx = 0; idx < volumes.size(); idx++) {
+      Volume *volume = volumes[idx];
+      Disk *disk = volume->fileSystem->disk;
+      pthread_mutex_lock(&volume->transactionLock);
+      // Objects have their blocks reserved, so this only fails if the disk
+      // changed behind our back. Whatever did get written is kept, the rest
+      // stays buffered for next time.
+      disk->beginTransaction();
+      if (volume->fileSystem->sync() < 0) {
+        cerr << "warning: ran out of space writing buffered objects" << endl;
+      }
+      disk->commit();
+      pthread_mutex_unlock(&volume->transactionLock);
+    }
+  }
+  return NULL;
+}
+
+Volume *DistributedFileSystemService::volumeFor(string name) {
+  return volumes[ufs_hash(name.data(), name.size()) % volumes.size()];
+}
+
+int DistributedFileSystemService::lookupPath(Volume *volume, vector<string> path) {
+  int inodeNumber = UFS_ROOT_DIRECTORY_INODE_NUMBER;
+  for (size_t idx = 0; idx < path.size(); idx++) {
+    inodeNumber = volume->fileSystem->lookup(inodeNumber, path[idx]);
+    if (inodeNumber < 0) {
+      throw ClientError::notFound();
+    }
+  }
+  return inodeNumber;
+}
+
+static string httpDate(time_t when) {
+  char date[64];
+  struct tm tm;
+  gmtime_r(&when, &tm);
+  strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  return date;
+}
+
+// If-None-Match wins over If-Modified-Since when a client sends both
+static bool notModified(HTTPRequest *request, string etag, time_t mtime) {
+  try {
+    string match = request->getHeader("If-None-Match");
+    return match == "*" || match.find(etag) != string::npos;
+  } catch (...) {
+  }
+  try {
+    string since = request->getHeader("If-Modified-Since");
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    if (strptime(since.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm) != NULL) {
+      return mtime <= timegm(&tm);
+    }
+  } catch (...) {
+  }
+  return false;
+}
+
 void DistributedFileSystemService::get(HTTPRequest *request, HTTPResponse *response) {
-  response->setBody("");
+  vector<string> path = request->getPathComponents();
+  path.erase(path.begin());
+
+  // The root directory is every volume's root directory put together,
+  // anything else lives on one volume
+  vector<Volume *> directories = volumes;
+  int inodeNumber = UFS_ROOT_DIRECTORY_INODE_NUMBER;
+  inode_t inode;
+  inode.type = UFS_DIRECTORY;
+  if (path.size() > 0) {
+    directories.assign(1, volumeFor(path[0]));
+    inodeNumber = lookupPath(directories[0], path);
+    if (directories[0]->fileSystem->stat(inodeNumber, &inode) < 0) {
+      throw ClientError::notFound();
+    }
+  }
+
+  if (inode.type == UFS_REGULAR_FILE) {
+    LocalFileSystem *fileSystem = directories[0]->fileSystem;
+    // The generation changes with every write, so it makes an ETag without
+    // looking at the data. It is read before the data so a write in between
+    // can only make the tag older than the body, never newer.
+    inode_attr_t attr;
+    if (fileSystem->getattr(inodeNumber, &attr) == 0 && attr.generation != 0) {
+      string etag = "\"" + to_string(inodeNumber) + "-" + to_string(attr.generation) + "\"";
+      response->setHeader("ETag", etag);
+      response->setHeader("Last-Modified", httpDate(attr.mtime));
+      if (notModified(request, etag, attr.mtime)) {
+        response->setStatus(304);
+        response->setBody("");
+        return;
+      }
+    }
+
+    // send the file straight out of the disk cache instead of copying it
+    vector<BlockSegment> segments;
+    if (fileSystem->readv(inodeNumber, segments, inode.size, 0) < 0) {
+      throw ClientError::badRequest();
+    }
+    response->setBody("");
+    for (size_t idx = 0; idx < segments.size(); idx++) {
+      response->appendBody(segments[idx].block, segments[idx].offset, segments[idx].length);
+    }
+    return;
+  }
+
+  // Directories are read a page at a time. With ?limit=N only one page is
+  // sent, in directory order instead of sorted, and the X-Ds3-Cookie header
+  // says where the next page starts (pass it back as ?cookie=). The root
+  // directory's volumes are read one after the other, its cookies are the
+  // volume's cookie times the number of volumes plus the volume's index.
+  long cookie = 0;
+  int limit = -1;
+  try {
+    map<string, string> params = request->getParams();
+    if (params.count("cookie")) {
+      cookie = stol(params["cookie"]);
+      if (cookie < 0) {
+        throw ClientError::badRequest();
+      }
+    }
+    if (params.count("limit")) {
+      limit = stoi(params["limit"]);
+      if (limit <= 0) {
+        throw ClientError::badRequest();
+      }
+    }
+  } catch (...) {
+    throw ClientError::badRequest();
+  }
+
+  int pageSize = limit > 0 ? limit : Geometry::entriesPerBlock;
+  vector<string> entries;
+  vector<dir_ent_t> page;
+  size_t volume = cookie % directories.size();
+  long volumeCookie = cookie / directories.size();
+  while (volume < directories.size()) {
+    LocalFileSystem *fileSystem = directories[volume]->fileSystem;
+    int ret = fileSystem->readdir(inodeNumber, page, pageSize, volumeCookie);
+    if (ret < 0) {
+      throw ClientError::badRequest();
+    } else if (ret == 0) {
+      volume++;
+      volumeCookie = 0;
+      continue;
+    }
+
+    for (size_t idx = 0; idx < page.size(); idx++) {
+      string name = page[idx].name;
+      if (name == "." || name == "..") {
+        continue;
+      }
+
+      inode_t entryInode;
+      if (fileSystem->stat(page[idx].inum, &entryInode) == 0 && entryInode.type == UFS_DIRECTORY) {
+        name += "/";
+      }
+      entries.push_back(name);
+    }
+    if (limit > 0) {
+      response->setHeader("X-Ds3-Cookie", to_string(volumeCookie * directories.size() + volume));
+      break;
+    }
+  }
+  if (limit < 0) {
+    sort(entries.begin(), entries.end());
+  }
+
+  stringstream body;
+  for (size_t idx = 0; idx < entries.size(); idx++) {
+    body << entries[idx] << "\n";
+  }
+  response->setBody(body.str());
+}
+
+// The data and indirect blocks a file of size bytes holds on this volume
+static int blocksFor(LocalFileSystem *fileSystem, super_t *super, int size) {
+  inode_t inode;
+  inode.type = UFS_REGULAR_FILE;
+  inode.size = size;
+  if (fileSystem->hasInlineData(super, &inode)) {
+    return 0;
+  }
+  int blocks = (size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+  return blocks + fileSystem->pointerBlocksNeeded(super, blocks);
 }
 
 void DistributedFileSystemService::put(HTTPRequest *request, HTTPResponse *response) {
+  vector<string> path = request->getPathComponents();
+  path.erase(path.begin());
+  if (path.size() == 0) {
+    throw ClientError::badRequest();
+  }
+  string body = request->getBody();
+  Volume *volume = volumeFor(path[0]);
+  LocalFileSystem *fileSystem = volume->fileSystem;
+
+  // turn away objects that can't fit before touching the disk, counting the
+  // blocks an existing object would give back. With dedup a body can share
+  // blocks that are already stored, so only write knows.
+  super_t super;
+  fileSystem->readSuperBlock(&super);
+  bool dedup = (super.features & UFS_FEATURE_DEDUP) != 0;
+  int blocks = dedup ? 0 : blocksFor(fileSystem, &super, body.size());
+
+  Disk *disk = fileSystem->disk;
+  pthread_mutex_lock(&volume->transactionLock);
+  FileSystemStats stats;
+  fileSystem->statfs(&stats);
+  if (blocks > stats.freeBlocks) {
+    inode_t inode;
+    try {
+      fileSystem->stat(lookupPath(volume, path), &inode);
+    } catch (ClientError &e) {
+      inode.type = UFS_DIRECTORY;
+    }
+    int old_blocks = 0;
+    if (inode.type == UFS_REGULAR_FILE) {
+      old_blocks = blocksFor(fileSystem, &super, inode.size);
+    }
+    if (blocks > stats.freeBlocks + old_blocks) {
+      pthread_mutex_unlock(&volume->transactionLock);
+      throw ClientError::insufficientStorage();
+    }
+  }
+  disk->beginTransaction();
+  int inodeNumber = -1;
+  try {
+    // create any missing directories along the way
+    int parentInodeNumber = UFS_ROOT_DIRECTORY_INODE_NUMBER;
+    for (size_t idx = 0; idx < path.size() - 1; idx++) {
+      int inodeNumber = fileSystem->create(parentInodeNumber, UFS_DIRECTORY, path[idx]);
+      if (inodeNumber == -EINVALIDTYPE) {
+        throw ClientError::conflict();
+      } else if (inodeNumber == -ENOTENOUGHSPACE) {
+        throw ClientError::insufficientStorage();
+      } else if (inodeNumber < 0) {
+        throw ClientError::badRequest();
+      }
+      parentInodeNumber = inodeNumber;
+    }
+
+    inodeNumber = fileSystem->create(parentInodeNumber, UFS_REGULAR_FILE, path.back());
+    if (inodeNumber == -ENOTENOUGHSPACE) {
+      throw ClientError::insufficientStorage();
+    } else if (inodeNumber < 0) {
+      throw ClientError::badRequest();
+    }
+
+    // write only rewrites the blocks that changed, so re-PUTs of mostly
+    // identical objects are cheap
+    int ret = fileSystem->write(inodeNumber, body.data(), body.size());
+    if (ret < 0) {
+      throw ClientError::badRequest();
+    } else if (ret < (int) body.size()) {
+      throw ClientError::insufficientStorage();
+    }
+    // the object goes to disk in this transaction unless write back is on
+    if (!writeBack && fileSystem->flush(inodeNumber) < 0) {
+      throw ClientError::insufficientStorage();
+    }
+  } catch (...) {
+    disk->rollback();
+    // the object may be gone along with its inode
+    if (inodeNumber >= 0) {
+      fileSystem->discard(inodeNumber);
+    }
+    fileSystem->loadStatistics();
+    pthread_mutex_unlock(&volume->transactionLock);
+    throw;
+  }
+  disk->commit();
+  pthread_mutex_unlock(&volume->transactionLock);
+
   response->setBody("");
 }
 
 void DistributedFileSystemService::del(HTTPRequest *request, HTTPResponse *response) {
+  vector<string> path = request->getPathComponents();
+  path.erase(path.begin());
+  if (path.size() == 0) {
+    throw ClientError::badRequest();
+  }
+
+  Volume *volume = volumeFor(path[0]);
+  LocalFileSystem *fileSystem = volume->fileSystem;
+  lookupPath(volume, path);
+  string name = path.back();
+  path.pop_back();
+  int parentInodeNumber = lookupPath(volume, path);
+
+  Disk *disk = fileSystem->disk;
+  pthread_mutex_lock(&volume->transactionLock);
+  disk->beginTransaction();
+  if (fileSystem->unlink(parentInodeNumber, name) < 0) {
+    disk->rollback();
+    fileSystem->loadStatistics();
+    pthread_mutex_unlock(&volume->transactionLock);
+    throw ClientError::badRequest();
+  }
+  disk->commit();
+  pthread_mutex_unlock(&volume->transactionLock);
+
+  response->setBody("");
+}
+
+void DistributedFileSystemService::move(HTTPRequest *request, HTTPResponse *response) {
+  vector<string> path = request->getPathComponents();
+  path.erase(path.begin());
+  if (path.size() == 0) {
+    throw ClientError::badRequest();
+  }
+
+  // the new name comes in the Destination header, as a path or a full URL
+  string destination;
+  try {
+    destination = request->getHeader("Destination");
+  } catch (...) {
+    throw ClientError::badRequest();
+  }
+  size_t scheme = destination.find("://");
+  if (scheme != string::npos) {
+    size_t slash = destination.find('/', scheme + 3);
+    destination = slash == string::npos ? "" : destination.substr(slash);
+  }
+  vector<string> destinationPath = StringUtils::split(destination, '/');
+  if (destinationPath.size() < 2 || destinationPath[0] != StringUtils::split(pathPrefix(), '/')[0]) {
+    throw ClientError::badRequest();
+  }
+  destinationPath.erase(destinationPath.begin());
+
+  // a rename only moves directory entries, which can't cross volumes
+  Volume *volume = volumeFor(path[0]);
+  LocalFileSystem *fileSystem = volume->fileSystem;
+  if (volumeFor(destinationPath[0]) != volume) {
+    throw ClientError::conflict();
+  }
+
+  string name = path.back();
+  path.pop_back();
+  int parentInodeNumber = lookupPath(volume, path);
+  string destinationName = destinationPath.back();
+  destinationPath.pop_back();
+  int destinationParentInodeNumber;
+  try {
+    destinationParentInodeNumber = lookupPath(volume, destinationPath);
+  } catch (ClientError &e) {
+    throw ClientError::conflict();
+  }
+
+  // only directory entries change, so this costs the same for any size
+  Disk *disk = fileSystem->disk;
+  pthread_mutex_lock(&volume->transactionLock);
+  disk->beginTransaction();
+  int ret = fileSystem->rename(parentInodeNumber, name, destinationParentInodeNumber, destinationName);
+  if (ret < 0) {
+    disk->rollback();
+    fileSystem->loadStatistics();
+    pthread_mutex_unlock(&volume->transactionLock);
+    if (ret == -ENOTFOUND) {
+      throw ClientError::notFound();
+    } else if (ret == -EINVALIDTYPE || ret == -EDIRNOTEMPTY) {
+      throw ClientError::conflict();
+    } else if (ret == -ENOTENOUGHSPACE) {
+      throw ClientError::insufficientStorage();
+    }
+    throw ClientError::badRequest();
+  }
+  disk->commit();
+  pthread_mutex_unlock(&volume->transactionLock);
+
   response->setBody("");
 }
@@ -6,6 +6,7 @@ using namespace std;
 
 HTTPResponse::HTTPResponse() {
   this->streaming = false;
+  this->bodySegmentsSize = 0;
   this->contentType = "text/html; charset=ISO-8859-1";
   this->headers["Server"] = "Gunrock Web";
   this->status = 200;
@@ -21,6 +22,18 @@ void HTTPResponse::setHeader(string name, string value) {
 
 void HTTPResponse::setBody(string data) {
   body = data;
+  bodyBuffers.clear();
+  bodySegments.clear();
+  bodySegmentsSize = 0;
+}
+
+void HTTPResponse::appendBody(shared_ptr<const unsigned char> buffer, int offset, int length) {
+  struct iovec segment;
+  segment.iov_base = (void *) (buffer.get() + offset);
+  segment.iov_len = length;
+  bodyBuffers.push_back(buffer);
+  bodySegments.push_back(segment);
+  bodySegmentsSize += length;
 }
 
 int HTTPResponse::getStatus() {
@@ -38,19 +51,21 @@ void HTTPResponse::setStatus(int status) {
 string HTTPResponse::statusToString() {
   if (status == 200) {
     return "OK";
+  } else if (status == 304) {
+    return "Not Modified";
   } else {
     return "Unknown";
   }
 }
 
-string HTTPResponse::response() {
+string HTTPResponse::header() {
   stringstream out;
   setHeader("Content-Type", contentType);
   if (streaming) {
     setHeader("Transfer-Encoding", "chunked");
   } else {
     stringstream len;
-    len << body.size();
+    len << body.size() + bodySegmentsSize;
     setHeader("Content-Length", len.str());
   }
 
@@ -60,9 +75,36 @@ string HTTPResponse::response() {
     out << iter->first << ": " << iter->second << "\r\n";
   }
   out << "\r\n";
-  if (body.size() > 0 && !streaming) {
+
+  return out.str();
+}
+
+string HTTPResponse::response() {
+  stringstream out;
+  out << header();
+  if (!streaming) {
     out << body;
+    for (size_t idx = 0; idx < bodySegments.size(); idx++) {
+      out.write((const char *) bodySegments[idx].iov_base, bodySegments[idx].iov_len);
+    }
   }
 
   return out.str();
 }
+
+void HTTPResponse::write(MySocket *client) {
+  if (bodySegments.size() == 0 || streaming) {
+    client->write(response());
+    return;
+  }
+
+  // header and string body first, then the segments straight from their buffers
+  string head = header() + body;
+  vector<struct iovec> iov;
+  struct iovec headSegment;
+  headSegment.iov_base = (void *) head.data();
+  headSegment.iov_len = head.size();
+  iov.push_back(headSegment);
+  iov.insert(iov.end(), bodySegments.begin(), bodySegments.end());
+  client->writev(&iov[0], iov.size());
+}
@@ -1,8 +1,11 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <algorithm>
 #include <assert.h>
 #include <cstring>
+#include <cstddef>
+#include <ctime>
 
 #include "LocalFileSystem.h"
 #include "ufs.h"
@@ -10,110 +13,1727 @@
 using namespace std;
 
 
+// Holds inode locks until it goes out of scope. Each lock is only taken
+// once, so inodes that share a lock are fine.
+class InodeLocks {
+ public:
+  InodeLocks(LocalFileSystem *fileSystem) {
+    this->fileSystem = fileSystem;
+  }
+  ~InodeLocks() {
+    unlock();
+  }
+
+  void lockShared(int inodeNumber) {
+    pthread_rwlock_t *lock = fileSystem->inodeLock(inodeNumber);
+    pthread_rwlock_rdlock(lock);
+    held.push_back(lock);
+  }
+
+  // Takes the locks of the inodes in lock order, skipping negative inode
+  // numbers. Adding a lock to ones already held is only allowed when it
+  // comes after them in the lock order.
+  void lockExclusive(int count, const int *inodeNumbers) {
+    vector<pthread_rwlock_t *> locks;
+    for (int i = 0; i < count; i++) {
+      if (inodeNumbers[i] >= 0) {
+        locks.push_back(fileSystem->inodeLock(inodeNumbers[i]));
+      }
+    }
+    sort(locks.begin(), locks.end());
+    for (size_t i = 0; i < locks.size(); i++) {
+      if (std::find(held.begin(), held.end(), locks[i]) == held.end()) {
+        pthread_rwlock_wrlock(locks[i]);
+        held.push_back(locks[i]);
+      }
+    }
+  }
+
+  void lockExclusive(int first, int second = -1) {
+    int inode_numbers[2] = { first, second };
+    lockExclusive(2, inode_numbers);
+  }
+
+  void unlock() {
+    for (size_t i = 0; i < held.size(); i++) {
+      pthread_rwlock_unlock(held[i]);
+    }
+    held.clear();
+  }
+
+ private:
+  LocalFileSystem *fileSystem;
+  vector<pthread_rwlock_t *> held;
+};
+
 LocalFileSystem::LocalFileSystem(Disk *disk) {
   this->disk = disk;
+  pthread_mutex_init(&renameLock, NULL);
+  for (int i = 0; i < INODE_LOCKS; i++) {
+    pthread_rwlock_init(&inodeLocks[i], NULL);
+  }
+  pthread_mutex_init(&inodeAllocatorLock, NULL);
+  pthread_mutex_init(&dataAllocatorLock, NULL);
+  pthread_mutex_init(&inodeTableLock, NULL);
+  pthread_mutex_init(&pendingLock, NULL);
+  delayedAllocation = false;
+  pendingBytes = 0;
+  reservedBlocks = 0;
+  loadStatistics();
+}
+
+pthread_rwlock_t *LocalFileSystem::inodeLock(int inodeNumber) {
+  return &inodeLocks[inodeNumber % INODE_LOCKS];
+}
+
+void LocalFileSystem::readSuperBlock(super_t *super) {
+  char local_buffer[UFS_BLOCK_SIZE];
+  disk->readBlock(0, local_buffer);
+  memcpy(super, local_buffer, sizeof(super_t));
+}
+
+static int countBits(const unsigned char *buffer, int bytes) {
+  int bits = 0;
+  for (int i = 0; i < bytes; i++) {
+    bits += __builtin_popcount(buffer[i]);
+  }
+  return bits;
+}
+
+void LocalFileSystem::loadStatistics() {
+  super_t super;
+  readSuperBlock(&super);
+
+  pthread_mutex_lock(&inodeAllocatorLock);
+  pthread_mutex_lock(&dataAllocatorLock);
+  PagedBitmap inode_bitmap(disk, super.inode_bitmap_addr, super.num_inodes);
+  freeInodes = super.num_inodes - inode_bitmap.countSet();
+  PagedBitmap data_bitmap(disk, super.data_bitmap_addr, super.num_data);
+  freeBlocks = super.num_data - data_bitmap.countSet();
+
+  dedupTable.clear();
+  dedupDirty.clear();
+  dedupIndex.clear();
+  storedBlocks = 0;
+  referencedBlocks = 0;
+  if (dedupBlocks(&super)) {
+    dedupTable.resize(super.dedup_table_len * Geometry::dedupEntriesPerBlock);
+    for (int i = 0; i < super.dedup_table_len; i++) {
+      disk->readBlock(super.dedup_table_addr + i, &dedupTable[i * Geometry::dedupEntriesPerBlock]);
+    }
+    dedupDirty.assign(super.dedup_table_len, false);
+    for (int i = 0; i < super.num_data; i++) {
+      if (dedupTable[i].hash != 0) {
+        dedupIndex.insert(make_pair(dedupTable[i].hash, super.data_region_addr + i));
+        storedBlocks += 1;
+        referencedBlocks += 1 + dedupTable[i].refs;
+      }
+    }
+  }
+  pthread_mutex_unlock(&dataAllocatorLock);
+  pthread_mutex_unlock(&inodeAllocatorLock);
+}
+
+int LocalFileSystem::statfs(FileSystemStats *stats) {
+  super_t super;
+  readSuperBlock(&super);
+
+  pthread_mutex_lock(&inodeAllocatorLock);
+  pthread_mutex_lock(&dataAllocatorLock);
+  stats->blockSize = UFS_BLOCK_SIZE;
+  stats->totalInodes = super.num_inodes;
+  stats->freeInodes = freeInodes;
+  stats->totalBlocks = super.num_data;
+  stats->freeBlocks = availableBlocks();
+  stats->storedBlocks = storedBlocks;
+  stats->referencedBlocks = referencedBlocks;
+  pthread_mutex_unlock(&dataAllocatorLock);
+  pthread_mutex_unlock(&inodeAllocatorLock);
+  return 0;
+}
+
+PagedBitmap::PagedBitmap(Disk *disk, int address, int numBits) {
+  this->disk = disk;
+  this->address = address;
+  this->numBits = numBits;
+  this->currentPage = -1;
+  this->setBits = 0;
+}
+
+const unsigned char *PagedBitmap::page(int index) {
+  map<int, vector<unsigned char> >::iterator changed_page = changed.find(index);
+  if (changed_page != changed.end()) {
+    return changed_page->second.data();
+  }
+  // bits are usually looked at in order, so keep the last block around
+  if (index != currentPage) {
+    current = disk->getBlock(address + index);
+    currentPage = index;
+  }
+  return current.get();
+}
+
+bool PagedBitmap::isSet(int bit) {
+  const unsigned char *bytes = page(bit / Geometry::bitsPerBlock);
+  int offset = bit % Geometry::bitsPerBlock;
+  return (bytes[offset / 8] & (1 << (offset % 8))) != 0;
+}
+
+void PagedBitmap::set(int bit) {
+  if (!isSet(bit)) {
+    setBits++;
+  }
+  int index = bit / Geometry::bitsPerBlock;
+  if (changed.find(index) == changed.end()) {
+    const unsigned char *bytes = page(index);
+    changed[index].assign(bytes, bytes + UFS_BLOCK_SIZE);
+  }
+  int offset = bit % Geometry::bitsPerBlock;
+  changed[index][offset / 8] |= (1 << (offset % 8));
+}
+
+void PagedBitmap::clear(int bit) {
+  if (isSet(bit)) {
+    setBits--;
+  }
+  int index = bit / Geometry::bitsPerBlock;
+  if (changed.find(index) == changed.end()) {
+    const unsigned char *bytes = page(index);
+    changed[index].assign(bytes, bytes + UFS_BLOCK_SIZE);
+  }
+  int offset = bit % Geometry::bitsPerBlock;
+  changed[index][offset / 8] &= ~(1 << (offset % 8));
+}
+
+int PagedBitmap::findClear(int start) {
+  int bit = start;
+  while (bit < numBits) {
+    const unsigned char *bytes = page(bit / Geometry::bitsPerBlock);
+    int page_end = std::min(numBits, (bit / Geometry::bitsPerBlock + 1) * Geometry::bitsPerBlock);
+    for (; bit < page_end; bit++) {
+      int offset = bit % Geometry::bitsPerBlock;
+      if (bytes[offset / 8] == 0xff) {
+        bit += 7 - (offset % 8);
+      } else if (!(bytes[offset / 8] & (1 << (offset % 8)))) {
+        return bit;
+      }
+    }
+  }
+  return -1;
+}
+
+int PagedBitmap::findClearRun(int start, int length) {
+  int bit = findClear(start);
+  while (bit >= 0) {
+    int run = 1;
+    while (run < length && bit + run < numBits && !isSet(bit + run)) {
+      run++;
+    }
+    if (run == length) {
+      return bit;
+    }
+    bit = findClear(bit + run);
+  }
+  return -1;
+}
+
+int PagedBitmap::countSet() {
+  int bits = 0;
+  for (int index = 0; index * Geometry::bitsPerBlock < numBits; index++) {
+    const unsigned char *bytes = page(index);
+    int page_bits = std::min(Geometry::bitsPerBlock, numBits - index * Geometry::bitsPerBlock);
+    bits += countBits(bytes, page_bits / 8);
+    if (page_bits % 8 != 0) {
+      bits += __builtin_popcount(bytes[page_bits / 8] & ((1 << (page_bits % 8)) - 1));
+    }
+  }
+  return bits;
+}
+
+int PagedBitmap::added() {
+  return setBits;
+}
+
+int PagedBitmap::flush() {
+  int added = 0;
+  map<int, vector<unsigned char> >::iterator iter;
+  for (iter = changed.begin(); iter != changed.end(); iter++) {
+    BlockBuffer old_block = disk->getBlock(address + iter->first);
+    if (memcmp(old_block.get(), iter->second.data(), UFS_BLOCK_SIZE) != 0) {
+      added += countBits(iter->second.data(), UFS_BLOCK_SIZE) - countBits(old_block.get(), UFS_BLOCK_SIZE);
+      disk->writeBlock(address + iter->first, iter->second.data());
+    }
+  }
+  changed.clear();
+  setBits = 0;
+  currentPage = -1;
+  current.reset();
+  return added;
+}
+
+void LocalFileSystem::writeInodeBitmap(super_t *super, PagedBitmap &inodeBitmap) {
+  freeInodes -= inodeBitmap.flush();
+}
+
+void LocalFileSystem::writeDataBitmap(super_t *super, PagedBitmap &dataBitmap) {
+  freeBlocks -= dataBitmap.flush();
+  if (dedupBlocks(super)) {
+    writeDedupTable(super);
+  }
+}
+
+void LocalFileSystem::readInodeBitmap(super_t *super, unsigned char *inodeBitmap) {
+  int bytes_to_read = super->num_inodes / 8;
+  int blocks_to_read = (bytes_to_read + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+
+  for (int i = 0; i < blocks_to_read; i++) {
+    char local_buffer[UFS_BLOCK_SIZE];
+    disk->readBlock(super->inode_bitmap_addr + i, local_buffer);
+
+    int copy_size = std::min(UFS_BLOCK_SIZE, bytes_to_read - (i * UFS_BLOCK_SIZE));
+    memcpy(inodeBitmap + (i * UFS_BLOCK_SIZE), local_buffer, copy_size);
+  }
+}
+
+void LocalFileSystem::writeInodeBitmap(super_t *super, unsigned char *inodeBitmap) {
+  int bytes_to_write = super->num_inodes / 8;
+  int blocks_to_write = (bytes_to_write + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+
+  for (int i = 0; i < blocks_to_write; i++) {
+    char local_buffer[UFS_BLOCK_SIZE] = {0};
+    int copy_size = std::min(UFS_BLOCK_SIZE, bytes_to_write - (i * UFS_BLOCK_SIZE));
+    memcpy(local_buffer, inodeBitmap + (i * UFS_BLOCK_SIZE), copy_size);
+
+    // keep the free count in step with the bits that changed
+    BlockBuffer old_block = disk->getBlock(super->inode_bitmap_addr + i);
+    if (memcmp(old_block.get(), local_buffer, UFS_BLOCK_SIZE) != 0) {
+      freeInodes -= countBits((unsigned char *) local_buffer, copy_size) - countBits(old_block.get(), copy_size);
+      disk->writeBlock(super->inode_bitmap_addr + i, local_buffer);
+    }
+  }
+}
+
+void LocalFileSystem::readDataBitmap(super_t *super, unsigned char *dataBitmap) {
+  int bytes_to_read = super->num_data / 8;
+  int blocks_to_read = (bytes_to_read + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+
+  for (int i = 0; i < blocks_to_read; i++) {
+    char local_buffer[UFS_BLOCK_SIZE];
+    disk->readBlock(super->data_bitmap_addr + i, local_buffer);
+
+    int copy_size = std::min(UFS_BLOCK_SIZE, bytes_to_read - (i * UFS_BLOCK_SIZE));
+    memcpy(dataBitmap + (i * UFS_BLOCK_SIZE), local_buffer, copy_size);
+  }
+}
+
+void LocalFileSystem::writeDataBitmap(super_t *super, unsigned char *dataBitmap) {
+  int bytes_to_write = super->num_data / 8;
+  int blocks_to_write = (bytes_to_write + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+
+  for (int i = 0; i < blocks_to_write; i++) {
+    char local_buffer[UFS_BLOCK_SIZE] = {0};
+    int copy_size = std::min(UFS_BLOCK_SIZE, bytes_to_write - (i * UFS_BLOCK_SIZE));
+    memcpy(local_buffer, dataBitmap + (i * UFS_BLOCK_SIZE), copy_size);
+
+    // keep the free count in step with the bits that changed
+    BlockBuffer old_block = disk->getBlock(super->data_bitmap_addr + i);
+    if (memcmp(old_block.get(), local_buffer, UFS_BLOCK_SIZE) != 0) {
+      freeBlocks -= countBits((unsigned char *) local_buffer, copy_size) - countBits(old_block.get(), copy_size);
+      disk->writeBlock(super->data_bitmap_addr + i, local_buffer);
+    }
+  }
+  if (dedupBlocks(super)) {
+    writeDedupTable(super);
+  }
+}
+
+void LocalFileSystem::readInodeRegion(super_t *super, inode_t *inodes) {
+  // Read for each inode
+  for (int i = 0; i < super->num_inodes; i++) {
+    char local_buffer[UFS_BLOCK_SIZE];
+    int block_offset = i / Geometry::inodesPerBlock;
+    int inode_offset = i % Geometry::inodesPerBlock;
+    disk->readBlock(super->inode_region_addr + block_offset, local_buffer);
+    memcpy(&inodes[i], (sizeof(inode_t) * inode_offset) + local_buffer, sizeof(inode_t));
+  }
+}
+
+void LocalFileSystem::writeInodeRegion(super_t *super, inode_t *inodes) {
+  for (int block_index = 0; block_index < super->inode_region_len; block_index++) {
+    char local_buffer[UFS_BLOCK_SIZE] = {0};
+    int start_inode = block_index * Geometry::inodesPerBlock;
+    int end_inode = std::min(start_inode + Geometry::inodesPerBlock, super->num_inodes);
+
+    memcpy(local_buffer, &inodes[start_inode], (end_inode - start_inode) * sizeof(inode_t));
+    if (!blockContains(super->inode_region_addr + block_index, local_buffer)) {
+      disk->writeBlock(super->inode_region_addr + block_index, local_buffer);
+    }
+  }
+}
+
+void LocalFileSystem::readInode(super_t *super, int inodeNumber, inode_t *inode) {
+  char local_buffer[UFS_BLOCK_SIZE];
+  disk->readBlock(super->inode_region_addr + inodeNumber / Geometry::inodesPerBlock, local_buffer);
+  memcpy(inode, local_buffer + (inodeNumber % Geometry::inodesPerBlock) * sizeof(inode_t), sizeof(inode_t));
+}
+
+void LocalFileSystem::writeInode(super_t *super, int inodeNumber, inode_t *inode) {
+  writeInodes(super, 1, &inodeNumber, inode);
+}
+
+void LocalFileSystem::writeInodes(super_t *super, int count, int *inodeNumbers, inode_t *inodes) {
+  char local_buffer[UFS_BLOCK_SIZE];
+
+  // inodes that share a block go out in a single write
+  pthread_mutex_lock(&inodeTableLock);
+  vector<bool> written(count, false);
+  for (int i = 0; i < count; i++) {
+    if (written[i]) {
+      continue;
+    }
+    int block = inodeNumbers[i] / Geometry::inodesPerBlock;
+    disk->readBlock(super->inode_region_addr + block, local_buffer);
+    for (int j = i; j < count; j++) {
+      if (inodeNumbers[j] / Geometry::inodesPerBlock == block) {
+        memcpy(local_buffer + (inodeNumbers[j] % Geometry::inodesPerBlock) * sizeof(inode_t), &inodes[j], sizeof(inode_t));
+        written[j] = true;
+      }
+    }
+    if (!blockContains(super->inode_region_addr + block, local_buffer)) {
+      disk->writeBlock(super->inode_region_addr + block, local_buffer);
+    }
+  }
+  pthread_mutex_unlock(&inodeTableLock);
+}
+
+bool LocalFileSystem::inodeAttrs(super_t *super) {
+  return (super->features & UFS_FEATURE_INODE_ATTRS) != 0;
+}
+
+void LocalFileSystem::touchInodes(super_t *super, int count, int *inodeNumbers) {
+  if (!inodeAttrs(super)) {
+    return;
+  }
+  inode_attr_t attrs[Geometry::attrsPerBlock];
+  unsigned int now = time(NULL);
+
+  // like writeInodes, one write per block, and an inode listed twice only
+  // changes once
+  pthread_mutex_lock(&inodeTableLock);
+  vector<bool> touched(count, false);
+  for (int i = 0; i < count; i++) {
+    if (touched[i] || inodeNumbers[i] < 0) {
+      continue;
+    }
+    int block = inodeNumbers[i] / Geometry::attrsPerBlock;
+    disk->readBlock(super->attr_table_addr + block, attrs);
+    for (int j = i; j < count; j++) {
+      if (touched[j] || inodeNumbers[j] < 0 || inodeNumbers[j] / Geometry::attrsPerBlock != block) {
+        continue;
+      }
+      touched[j] = true;
+      if (std::find(inodeNumbers + i, inodeNumbers + j, inodeNumbers[j]) == inodeNumbers + j) {
+        inode_attr_t &attr = attrs[inodeNumbers[j] % Geometry::attrsPerBlock];
+        attr.mtime = now;
+        attr.generation += 1;
+      }
+    }
+    disk->writeBlock(super->attr_table_addr + block, attrs);
+  }
+  pthread_mutex_unlock(&inodeTableLock);
+}
+
+void LocalFileSystem::freeDataBlock(super_t *super, PagedBitmap &dataBitmap, unsigned int blockNumber) {
+  int bit = blockNumber - super->data_region_addr;
+  if (bit < 0 || bit >= super->num_data) {
+    return;
+  }
+  // only indexed blocks can be shared
+  if (dedupBlocks(super) && dedupTable[bit].hash != 0) {
+    dedup_ent_t &entry = dedupEntry(super, blockNumber);
+    if (entry.refs > 0) {
+      entry.refs -= 1;
+      referencedBlocks -= 1;
+      return;
+    }
+    unindexBlock(super, blockNumber);
+  }
+  dataBitmap.clear(bit);
+}
+
+bool LocalFileSystem::dedupBlocks(super_t *super) {
+  return (super->features & UFS_FEATURE_DEDUP) != 0;
+}
+
+dedup_ent_t &LocalFileSystem::dedupEntry(super_t *super, unsigned int blockNumber) {
+  int index = blockNumber - super->data_region_addr;
+  dedupDirty[index / Geometry::dedupEntriesPerBlock] = true;
+  return dedupTable[index];
+}
+
+void LocalFileSystem::indexBlock(super_t *super, unsigned int blockNumber, unsigned int hash) {
+  dedupEntry(super, blockNumber).hash = hash;
+  dedupIndex.insert(make_pair(hash, blockNumber));
+  storedBlocks += 1;
+  referencedBlocks += 1;
+}
+
+void LocalFileSystem::unindexBlock(super_t *super, unsigned int blockNumber) {
+  dedup_ent_t &entry = dedupEntry(super, blockNumber);
+  pair<DedupIndex::iterator, DedupIndex::iterator> range = dedupIndex.equal_range(entry.hash);
+  for (DedupIndex::iterator iter = range.first; iter != range.second; iter++) {
+    if (iter->second == blockNumber) {
+      dedupIndex.erase(iter);
+      break;
+    }
+  }
+  storedBlocks -= 1;
+  referencedBlocks -= 1 + entry.refs;
+  entry.hash = 0;
+}
+
+void LocalFileSystem::writeDedupTable(super_t *super) {
+  for (int i = 0; i < super->dedup_table_len; i++) {
+    if (dedupDirty[i] && !blockContains(super->dedup_table_addr + i, &dedupTable[i * Geometry::dedupEntriesPerBlock])) {
+      disk->writeBlock(super->dedup_table_addr + i, &dedupTable[i * Geometry::dedupEntriesPerBlock]);
+    }
+    dedupDirty[i] = false;
+  }
+}
+
+bool LocalFileSystem::storeBlock(super_t *super, BlockMap &map, int index, const void *contents) {
+  unsigned int hash = ufs_block_hash(contents);
+  unsigned int block = map.blocks[index];
+  int bit = block - super->data_region_addr;
+  pthread_mutex_lock(&dataAllocatorLock);
+  if (dedupTable[bit].hash == hash && blockContains(block, contents)) {
+    pthread_mutex_unlock(&dataAllocatorLock);
+    return true;
+  }
+
+  // hashes can collide, so only a block with the same contents is a copy
+  unsigned int copy = 0;
+  pair<DedupIndex::iterator, DedupIndex::iterator> range = dedupIndex.equal_range(hash);
+  for (DedupIndex::iterator iter = range.first; iter != range.second; iter++) {
+    if (iter->second != block && blockContains(iter->second, contents)) {
+      copy = iter->second;
+      break;
+    }
+  }
+
+  PagedBitmap data_bitmap(disk, super->data_bitmap_addr, super->num_data);
+  if (copy != 0) {
+    // share the copy and let go of the old block
+    dedupEntry(super, copy).refs += 1;
+    referencedBlocks += 1;
+    freeDataBlock(super, data_bitmap, block);
+    map.blocks[index] = copy;
+    writeDataBitmap(super, data_bitmap);
+    pthread_mutex_unlock(&dataAllocatorLock);
+    return true;
+  }
+
+  if (dedupTable[bit].refs > 0) {
+    // other files still read the old block, so write to a new one
+    int free_bit = availableBlocks(&data_bitmap) > 0 ? data_bitmap.findClear(0) : -1;
+    if (free_bit < 0) {
+      pthread_mutex_unlock(&dataAllocatorLock);
+      return false;
+    }
+    data_bitmap.set(free_bit);
+    dedupEntry(super, block).refs -= 1;
+    referencedBlocks -= 1;
+    block = super->data_region_addr + free_bit;
+    map.blocks[index] = block;
+    writeDataBitmap(super, data_bitmap);
+  } else if (dedupTable[bit].hash != 0) {
+    unindexBlock(super, block);
+  }
+
+  if (!blockContains(block, contents)) {
+    disk->writeBlock(block, (void *) contents);
+  }
+  indexBlock(super, block, hash);
+  writeDedupTable(super);
+  pthread_mutex_unlock(&dataAllocatorLock);
+  return true;
+}
+
+bool LocalFileSystem::blockContains(unsigned int blockNumber, const void *buffer) {
+  BlockBuffer block = disk->getBlock(blockNumber);
+  return memcmp(block.get(), buffer, UFS_BLOCK_SIZE) == 0;
+}
+
+int LocalFileSystem::numDirectPtrs(super_t *super) {
+  if (super->version >= UFS_VERSION_INDIRECT) {
+    return INDIRECT_PTR;
+  }
+  return DIRECT_PTRS;
+}
+
+bool LocalFileSystem::hasInlineData(super_t *super, inode_t *inode) {
+  return (super->features & UFS_FEATURE_INLINE_DATA) && inode->type == UFS_REGULAR_FILE &&
+    inode->size <= UFS_INLINE_DATA_SIZE;
+}
+
+int LocalFileSystem::maxFileSize(super_t *super) {
+  if (super->version >= UFS_VERSION_INDIRECT) {
+    return MAX_FILE_SIZE_INDIRECT;
+  }
+  return MAX_FILE_SIZE;
+}
+
+int LocalFileSystem::pointerBlocksNeeded(super_t *super, int numBlocks) {
+  int direct = numDirectPtrs(super);
+  if (numBlocks <= direct) {
+    return 0;
+  } else if (numBlocks <= direct + Geometry::pointersPerBlock) {
+    return 1;
+  }
+
+  // the double indirect block plus one child for every Geometry::pointersPerBlock blocks
+  int remaining = numBlocks - direct - Geometry::pointersPerBlock;
+  return 2 + (remaining + Geometry::pointersPerBlock - 1) / Geometry::pointersPerBlock;
+}
+
+void LocalFileSystem::readBlockMap(super_t *super, inode_t *inode, BlockMap &map) {
+  map.blocks.clear();
+  map.pointerBlocks.clear();
+  if (hasInlineData(super, inode)) {
+    return;
+  }
+
+  int blocks = inode->size / UFS_BLOCK_SIZE;
+  if ((inode->size % UFS_BLOCK_SIZE) != 0) {
+    blocks += 1;
+  }
+  map.blocks.reserve(blocks);
+
+  int direct = numDirectPtrs(super);
+  for (int i = 0; i < std::min(blocks, direct); i++) {
+    map.blocks.push_back(inode->direct[i]);
+  }
+  if (blocks <= direct) {
+    return;
+  }
+
+  unsigned int pointers[Geometry::pointersPerBlock];
+  map.pointerBlocks.push_back(inode->direct[INDIRECT_PTR]);
+  disk->readBlock(inode->direct[INDIRECT_PTR], pointers);
+  int remaining = blocks - direct;
+  for (int i = 0; i < std::min(remaining, Geometry::pointersPerBlock); i++) {
+    map.blocks.push_back(pointers[i]);
+  }
+  remaining -= Geometry::pointersPerBlock;
+  if (remaining <= 0) {
+    return;
+  }
+
+  unsigned int double_pointers[Geometry::pointersPerBlock];
+  map.pointerBlocks.push_back(inode->direct[DOUBLE_INDIRECT_PTR]);
+  disk->readBlock(inode->direct[DOUBLE_INDIRECT_PTR], double_pointers);
+  for (int i = 0; remaining > 0; i++) {
+    map.pointerBlocks.push_back(double_pointers[i]);
+    disk->readBlock(double_pointers[i], pointers);
+    for (int j = 0; j < std::min(remaining, Geometry::pointersPerBlock); j++) {
+      map.blocks.push_back(pointers[j]);
+    }
+    remaining -= Geometry::pointersPerBlock;
+  }
+}
+
+void LocalFileSystem::readBlockRange(super_t *super, inode_t *inode, int firstBlock, int numBlocks,
+                                     vector<unsigned int> &blocks) {
+  blocks.clear();
+  blocks.reserve(numBlocks);
+
+  // block 0 is the super block, so it never names a loaded pointer block
+  int direct = numDirectPtrs(super);
+  unsigned int pointers[Geometry::pointersPerBlock];
+  unsigned int loaded = 0;
+  unsigned int double_pointers[Geometry::pointersPerBlock];
+  bool double_loaded = false;
+
+  for (int i = firstBlock; i < firstBlock + numBlocks; i++) {
+    unsigned int pointer_block;
+    int index;
+    if (i < direct) {
+      blocks.push_back(inode->direct[i]);
+      continue;
+    } else if (i < direct + Geometry::pointersPerBlock) {
+      pointer_block = inode->direct[INDIRECT_PTR];
+      index = i - direct;
+    } else {
+      if (!double_loaded) {
+        disk->readBlock(inode->direct[DOUBLE_INDIRECT_PTR], double_pointers);
+        double_loaded = true;
+      }
+      int double_index = i - direct - Geometry::pointersPerBlock;
+      pointer_block = double_pointers[double_index / Geometry::pointersPerBlock];
+      index = double_index % Geometry::pointersPerBlock;
+    }
+
+    if (loaded != pointer_block) {
+      disk->readBlock(pointer_block, pointers);
+      loaded = pointer_block;
+    }
+    blocks.push_back(pointers[index]);
+  }
 }
 
-void LocalFileSystem::readSuperBlock(super_t *super) {
-  char local_buffer[UFS_BLOCK_SIZE];
-  disk->readBlock(0, local_buffer);
-  memcpy(super, local_buffer, sizeof(super_t));
-}
+void LocalFileSystem::writeBlockMap(super_t *super, inode_t *inode, BlockMap &map, int fromBlock) {
+  int blocks = map.blocks.size();
+  int direct = numDirectPtrs(super);
+  assert((int) map.pointerBlocks.size() == pointerBlocksNeeded(super, blocks));
+
+  for (int i = 0; i < DIRECT_PTRS; i++) {
+    inode->direct[i] = (i < direct && i < blocks) ? map.blocks[i] : 0;
+  }
+  if (blocks <= direct) {
+    return;
+  }
+
+  unsigned int pointers[Geometry::pointersPerBlock];
+  int next = direct;
+  inode->direct[INDIRECT_PTR] = map.pointerBlocks[0];
+  if (fromBlock < direct + Geometry::pointersPerBlock) {
+    for (int i = 0; i < Geometry::pointersPerBlock; i++) {
+      pointers[i] = next + i < blocks ? map.blocks[next + i] : 0;
+    }
+    if (!blockContains(map.pointerBlocks[0], pointers)) {
+      disk->writeBlock(map.pointerBlocks[0], pointers);
+    }
+  }
+  next += Geometry::pointersPerBlock;
+  if (next >= blocks) {
+    return;
+  }
+
+  // children that end before fromBlock are unchanged, and so is the double
+  // indirect block unless one of its children changed
+  unsigned int double_pointers[Geometry::pointersPerBlock] = {0};
+  bool children_changed = false;
+  for (int i = 0; next < blocks; i++, next += Geometry::pointersPerBlock) {
+    double_pointers[i] = map.pointerBlocks[i + 2];
+    if (next + Geometry::pointersPerBlock <= fromBlock) {
+      continue;
+    }
+    for (int j = 0; j < Geometry::pointersPerBlock; j++) {
+      pointers[j] = next + j < blocks ? map.blocks[next + j] : 0;
+    }
+    if (!blockContains(double_pointers[i], pointers)) {
+      disk->writeBlock(double_pointers[i], pointers);
+    }
+    children_changed = true;
+  }
+  inode->direct[DOUBLE_INDIRECT_PTR] = map.pointerBlocks[1];
+  if (children_changed && !blockContains(map.pointerBlocks[1], double_pointers)) {
+    disk->writeBlock(map.pointerBlocks[1], double_pointers);
+  }
+}
+
+int LocalFileSystem::resizeBlockMap(super_t *super, BlockMap &map, PagedBitmap &dataBitmap, int numBlocks,
+                                    bool contiguous) {
+  while ((int) map.blocks.size() > numBlocks) {
+    freeDataBlock(super, dataBitmap, map.blocks.back());
+    map.blocks.pop_back();
+  }
+  int pointer_blocks = pointerBlocksNeeded(super, map.blocks.size());
+  while ((int) map.pointerBlocks.size() > pointer_blocks) {
+    freeDataBlock(super, dataBitmap, map.pointerBlocks.back());
+    map.pointerBlocks.pop_back();
+  }
+
+  // Allocate any new indirect blocks right before the data they point to.
+  // We only ever allocate here, so each search can pick up where the last
+  // one stopped.
+  int search_start = 0;
+  int growth = numBlocks - map.blocks.size() + pointerBlocksNeeded(super, numBlocks) - map.pointerBlocks.size();
+  if (contiguous && growth > 1) {
+    search_start = std::max(0, dataBitmap.findClearRun(0, growth));
+  }
+  while ((int) map.blocks.size() < numBlocks) {
+    int new_pointers = pointerBlocksNeeded(super, map.blocks.size() + 1) - map.pointerBlocks.size();
+    vector<unsigned int> allocated;
+    for (int i = 0; i < new_pointers + 1; i++) {
+      int bit = availableBlocks(&dataBitmap) > 0 ? dataBitmap.findClear(search_start) : -1;
+      if (bit < 0) {
+        break;
+      }
+      dataBitmap.set(bit);
+      search_start = bit + 1;
+      allocated.push_back(super->data_region_addr + bit);
+    }
+
+    if ((int) allocated.size() < new_pointers + 1) {
+      for (size_t i = 0; i < allocated.size(); i++) {
+        freeDataBlock(super, dataBitmap, allocated[i]);
+      }
+      break;
+    }
+    map.pointerBlocks.insert(map.pointerBlocks.end(), allocated.begin(), allocated.end() - 1);
+    map.blocks.push_back(allocated.back());
+  }
+
+  return map.blocks.size();
+}
+
+int LocalFileSystem::lookup(int parentInodeNumber, string name) {
+  super_t super;
+  readSuperBlock(&super);
+
+  // checking if name even exists or invalid parent inode
+  if (parentInodeNumber < 0 || parentInodeNumber >= super.num_inodes) {
+    return -EINVALIDINODE;
+  }
+
+  InodeLocks locks(this);
+  locks.lockShared(parentInodeNumber);
+  inode_t inode;
+  readInode(&super, parentInodeNumber, &inode);
+  if (inode.type != UFS_DIRECTORY) {
+    return -EINVALIDINODE;
+  }
+
+  return findEntry(&super, &inode, name);
+}
+
+bool LocalFileSystem::hashedDirectories(super_t *super) {
+  return (super->features & UFS_FEATURE_DIR_INDEX) != 0;
+}
+
+static unsigned int nameHash(const char *name) {
+  return ufs_hash(name, strlen(name));
+}
+
+// The block that holds hash in a hashed directory of numBlocks blocks,
+// which is always a power of two
+static int hashBlock(unsigned int hash, int numBlocks) {
+  int bits = 0;
+  while ((1 << bits) < numBlocks) {
+    bits++;
+  }
+  return bits == 0 ? 0 : hash >> (32 - bits);
+}
+
+static int hashBucket(const char *name, int numBlocks) {
+  if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+    return 0;
+  }
+  return hashBlock(nameHash(name), numBlocks);
+}
+
+static bool hashOrder(const dir_ent_t &a, const dir_ent_t &b) {
+  unsigned int hash_a = nameHash(a.name);
+  unsigned int hash_b = nameHash(b.name);
+  if (hash_a != hash_b) {
+    return hash_a < hash_b;
+  }
+  return strcmp(a.name, b.name) < 0;
+}
+
+static void clearEntries(dir_ent_t *entries, int count) {
+  memset(entries, 0, count * sizeof(dir_ent_t));
+  for (int i = 0; i < count; i++) {
+    entries[i].inum = -1;
+  }
+}
+
+// Spreads entries, already in hash order, over numBlocks hashed directory
+// blocks. Returns false if one of the blocks would overflow.
+static bool layoutHashed(vector<dir_ent_t> &dots, vector<dir_ent_t> &entries, int numBlocks,
+                         vector<dir_ent_t> &blocks) {
+  blocks.resize(numBlocks * Geometry::entriesPerBlock);
+  clearEntries(&blocks[0], blocks.size());
+
+  vector<int> used(numBlocks, 0);
+  for (size_t i = 0; i < dots.size(); i++) {
+    blocks[used[0]++] = dots[i];
+  }
+  for (size_t i = 0; i < entries.size(); i++) {
+    int bucket = hashBucket(entries[i].name, numBlocks);
+    if (used[bucket] == Geometry::entriesPerBlock) {
+      return false;
+    }
+    blocks[bucket * Geometry::entriesPerBlock + used[bucket]++] = entries[i];
+  }
+  return true;
+}
+
+void LocalFileSystem::readEntries(BlockMap &map, int numBlocks, vector<dir_ent_t> &dots,
+                                  vector<dir_ent_t> &entries) {
+  dir_ent_t block[Geometry::entriesPerBlock];
+  for (int i = 0; i < numBlocks; i++) {
+    disk->readBlock(map.blocks[i], block);
+    for (int N = 0; N < Geometry::entriesPerBlock && block[N].name[0] != '\0'; N++) {
+      if (strcmp(block[N].name, ".") == 0 || strcmp(block[N].name, "..") == 0) {
+        dots.push_back(block[N]);
+      } else {
+        entries.push_back(block[N]);
+      }
+    }
+  }
+}
+
+int LocalFileSystem::findEntry(super_t *super, inode_t *directory, string name) {
+  dir_ent_t entries[Geometry::entriesPerBlock];
+
+  // only the block the name hashes to can hold it
+  if (hashedDirectories(super)) {
+    vector<unsigned int> block;
+    int bucket = hashBucket(name.c_str(), directory->size / UFS_BLOCK_SIZE);
+    readBlockRange(super, directory, bucket, 1, block);
+    disk->readBlock(block[0], entries);
+    for (int N = 0; N < Geometry::entriesPerBlock && entries[N].name[0] != '\0'; N++) {
+      if (std::strcmp(entries[N].name, name.c_str()) == 0) {
+        return entries[N].inum;
+      }
+    }
+    return -ENOTFOUND;
+  }
+
+  BlockMap map;
+  readBlockMap(super, directory, map);
+  int num_entries = directory->size / sizeof(dir_ent_t);
+
+  for (size_t i = 0; i < map.blocks.size(); i++) {
+    disk->readBlock(map.blocks[i], entries);
+    for (int N = 0; N < Geometry::entriesPerBlock && (int) i * Geometry::entriesPerBlock + N < num_entries; N++) {
+      if (std::strcmp(entries[N].name, name.c_str()) == 0) {
+        return entries[N].inum;
+      }
+    }
+  }
+
+  return -ENOTFOUND;
+}
+
+int LocalFileSystem::blocksWithEntry(super_t *super, inode_t *directory, BlockMap &map, string name) {
+  int blocks = map.blocks.size();
+
+  if (!hashedDirectories(super)) {
+    int size = directory->size + sizeof(dir_ent_t);
+    if (size > maxFileSize(super)) {
+      return -1;
+    }
+    return (size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+  }
+
+  // usually there's room in the name's block
+  dir_ent_t entries[Geometry::entriesPerBlock];
+  disk->readBlock(map.blocks[hashBucket(name.c_str(), blocks)], entries);
+  if (entries[Geometry::entriesPerBlock - 1].name[0] == '\0') {
+    return blocks;
+  }
+
+  // otherwise double until every block fits
+  vector<dir_ent_t> dots, all;
+  readEntries(map, blocks, dots, all);
+  dir_ent_t entry;
+  memset(&entry, 0, sizeof(dir_ent_t));
+  strcpy(entry.name, name.c_str());
+  all.push_back(entry);
+  sort(all.begin(), all.end(), hashOrder);
+
+  vector<dir_ent_t> layout;
+  for (long new_blocks = blocks * 2; new_blocks * UFS_BLOCK_SIZE <= maxFileSize(super); new_blocks *= 2) {
+    if (layoutHashed(dots, all, new_blocks, layout)) {
+      return new_blocks;
+    }
+  }
+  return -1;
+}
+
+void LocalFileSystem::addEntry(super_t *super, inode_t *directory, BlockMap &map, int oldBlocks,
+                               string name, int inodeNumber) {
+  dir_ent_t entry;
+  memset(&entry, 0, sizeof(dir_ent_t));
+  strcpy(entry.name, name.c_str());
+  entry.inum = inodeNumber;
+
+  if (!hashedDirectories(super)) {
+    // append, starting a new block when the last one is full
+    dir_ent_t entries[Geometry::entriesPerBlock];
+    int slot = (directory->size / sizeof(dir_ent_t)) % Geometry::entriesPerBlock;
+    if (slot == 0) {
+      clearEntries(entries, Geometry::entriesPerBlock);
+    } else {
+      disk->readBlock(map.blocks.back(), entries);
+    }
+    entries[slot] = entry;
+    disk->writeBlock(map.blocks.back(), entries);
+    directory->size += sizeof(dir_ent_t);
+    return;
+  }
+
+  int blocks = map.blocks.size();
+  if (blocks == oldBlocks) {
+    // insert it in hash order, only its block changes
+    dir_ent_t entries[Geometry::entriesPerBlock];
+    int bucket = hashBucket(entry.name, blocks);
+    disk->readBlock(map.blocks[bucket], entries);
+    int used = 0;
+    while (used < Geometry::entriesPerBlock && entries[used].name[0] != '\0') {
+      used++;
+    }
+    assert(used < Geometry::entriesPerBlock);
+    int slot = used;
+    while (slot > 0 && (bucket != 0 || slot > 2) && hashOrder(entry, entries[slot - 1])) {
+      entries[slot] = entries[slot - 1];
+      slot--;
+    }
+    entries[slot] = entry;
+    disk->writeBlock(map.blocks[bucket], entries);
+    return;
+  }
+
+  // the directory grew, so lay every entry out again
+  vector<dir_ent_t> dots, all;
+  readEntries(map, oldBlocks, dots, all);
+  all.push_back(entry);
+  sort(all.begin(), all.end(), hashOrder);
+  vector<dir_ent_t> layout;
+  bool fits = layoutHashed(dots, all, blocks, layout);
+  assert(fits);
+  for (int i = 0; i < blocks; i++) {
+    if (i >= oldBlocks || !blockContains(map.blocks[i], &layout[i * Geometry::entriesPerBlock])) {
+      disk->writeBlock(map.blocks[i], &layout[i * Geometry::entriesPerBlock]);
+    }
+  }
+  directory->size = blocks * UFS_BLOCK_SIZE;
+}
+
+int LocalFileSystem::removeEntry(super_t *super, inode_t *directory, BlockMap &map, string name) {
+  if (hashedDirectories(super)) {
+    // close the gap in the name's block, the rest of the directory stays
+    dir_ent_t entries[Geometry::entriesPerBlock];
+    int bucket = hashBucket(name.c_str(), map.blocks.size());
+    disk->readBlock(map.blocks[bucket], entries);
+    int removed = 0;
+    while (strcmp(entries[removed].name, name.c_str()) != 0) {
+      removed++;
+      assert(removed < Geometry::entriesPerBlock);
+    }
+    for (int M = removed; M < Geometry::entriesPerBlock - 1; M++) {
+      entries[M] = entries[M + 1];
+    }
+    clearEntries(&entries[Geometry::entriesPerBlock - 1], 1);
+    disk->writeBlock(map.blocks[bucket], entries);
+    return map.blocks.size();
+  }
+
+  // Find the entry, then shift every later entry down by one. Only the
+  // blocks from the removed entry onward change.
+  int num_entries = directory->size / sizeof(dir_ent_t);
+  vector<dir_ent_t> entries(map.blocks.size() * Geometry::entriesPerBlock);
+  for (size_t i = 0; i < map.blocks.size(); i++) {
+    disk->readBlock(map.blocks[i], &entries[i * Geometry::entriesPerBlock]);
+  }
+
+  int removed = -1;
+  for (int N = 0; N < num_entries; N++) {
+    if (std::strcmp(entries[N].name, name.c_str()) == 0) {
+      removed = N;
+      break;
+    }
+  }
+  assert(removed >= 0);
+
+  for (int M = removed; M < num_entries - 1; M++) {
+    entries[M] = entries[M + 1];
+  }
+  clearEntries(&entries[num_entries - 1], 1);
+
+  directory->size -= sizeof(dir_ent_t);
+  int blocks = directory->size / UFS_BLOCK_SIZE;
+  if ((directory->size % UFS_BLOCK_SIZE) != 0) {
+    blocks += 1;
+  }
+  for (int i = removed / Geometry::entriesPerBlock; i < blocks; i++) {
+    disk->writeBlock(map.blocks[i], &entries[i * Geometry::entriesPerBlock]);
+  }
+  return blocks;
+}
+
+void LocalFileSystem::replaceEntry(super_t *super, inode_t *directory, BlockMap &map, string name,
+                                   int inodeNumber) {
+  dir_ent_t entries[Geometry::entriesPerBlock];
+  int first = 0;
+  int last = map.blocks.size() - 1;
+  if (hashedDirectories(super)) {
+    first = last = hashBucket(name.c_str(), map.blocks.size());
+  }
+
+  for (int i = first; i <= last; i++) {
+    disk->readBlock(map.blocks[i], entries);
+    for (int N = 0; N < Geometry::entriesPerBlock; N++) {
+      if (strcmp(entries[N].name, name.c_str()) == 0) {
+        entries[N].inum = inodeNumber;
+        disk->writeBlock(map.blocks[i], entries);
+        return;
+      }
+    }
+  }
+  assert(false);
+}
+
+bool LocalFileSystem::directoryIsEmpty(super_t *super, inode_t *directory) {
+  if (!hashedDirectories(super)) {
+    return directory->size <= (int) (2 * sizeof(dir_ent_t));
+  }
+
+  BlockMap map;
+  readBlockMap(super, directory, map);
+  vector<dir_ent_t> dots, entries;
+  readEntries(map, map.blocks.size(), dots, entries);
+  return entries.empty();
+}
+
+int LocalFileSystem::stat(int inodeNumber, inode_t *inode) {
+  super_t super;
+  readSuperBlock(&super);
+
+  if (inodeNumber < 0 || inodeNumber >= super.num_inodes) {
+    return -EINVALIDINODE;
+  }
+
+  InodeLocks locks(this);
+  locks.lockShared(inodeNumber);
+  readInode(&super, inodeNumber, inode);
+  PendingFile file;
+  if (findPending(inodeNumber, file)) {
+    inode->size = file.size;
+  }
+
+  return 0;
+}
+
+int LocalFileSystem::getattr(int inodeNumber, inode_attr_t *attr) {
+  super_t super;
+  readSuperBlock(&super);
+
+  if (inodeNumber < 0 || inodeNumber >= super.num_inodes) {
+    return -EINVALIDINODE;
+  }
+
+  memset(attr, 0, sizeof(inode_attr_t));
+  if (!inodeAttrs(&super)) {
+    return 0;
+  }
+
+  InodeLocks locks(this);
+  locks.lockShared(inodeNumber);
+  BlockBuffer block = disk->getBlock(super.attr_table_addr + inodeNumber / Geometry::attrsPerBlock);
+  memcpy(attr, block.get() + (inodeNumber % Geometry::attrsPerBlock) * sizeof(inode_attr_t), sizeof(inode_attr_t));
+
+  return 0;
+}
+
+int LocalFileSystem::read(int inodeNumber, void *buffer, int size) {
+  return read(inodeNumber, buffer, size, 0);
+}
+
+int LocalFileSystem::read(int inodeNumber, void *buffer, int size, int offset) {
+  char *data_buffer = static_cast<char *>(buffer);
+  super_t super;
+  readSuperBlock(&super);
+
+  // Check for valid inode #
+  if (inodeNumber < 0 || inodeNumber >= super.num_inodes) {
+    return -EINVALIDINODE;
+  }
+  
+  // the lock keeps the file from changing under us until we're done
+  InodeLocks locks(this);
+  locks.lockShared(inodeNumber);
+  inode_t inode;
+  readInode(&super, inodeNumber, &inode);
+  PendingFile file;
+  bool buffered = findPending(inodeNumber, file);
+  if (buffered) {
+    inode.size = file.size;
+  }
+
+  // size is valid?
+  if (size < 0 || offset < 0) {
+    return -EINVALIDSIZE;
+  } else if (offset >= inode.size) {
+    return 0;
+  }
+  size = std::min(size, inode.size - offset);
+  if (size == 0) {
+    return 0;
+  } else if (buffered) {
+    memcpy(data_buffer, file.data.get() + offset, size);
+    return size;
+  } else if (hasInlineData(&super, &inode)) {
+    memcpy(data_buffer, (char *) inode.direct + offset, size);
+    return size;
+  }
+
+  int first_block = offset / UFS_BLOCK_SIZE;
+  int last_block = (offset + size - 1) / UFS_BLOCK_SIZE;
+  vector<unsigned int> blocks;
+  readBlockRange(&super, &inode, first_block, last_block - first_block + 1, blocks);
+
+  // Full blocks go straight into the caller's buffer, only the ends are copied
+  int bytes_read = 0;
+  for (int i = first_block; bytes_read < size; i++) {
+    int block_offset = (offset + bytes_read) % UFS_BLOCK_SIZE;
+    int to_read = std::min(UFS_BLOCK_SIZE - block_offset, size - bytes_read);
+    if (to_read == UFS_BLOCK_SIZE) {
+      disk->readBlock(blocks[i - first_block], data_buffer + bytes_read);
+    } else {
+      char block[UFS_BLOCK_SIZE];
+      disk->readBlock(blocks[i - first_block], block);
+      memcpy(data_buffer + bytes_read, block + block_offset, to_read);
+    }
+    bytes_read += to_read;
+  }
+
+  return bytes_read;
+}
+
+int LocalFileSystem::readv(int inodeNumber, vector<BlockSegment> &segments, int size, int offset) {
+  super_t super;
+  readSuperBlock(&super);
+  segments.clear();
+
+  if (inodeNumber < 0 || inodeNumber >= super.num_inodes) {
+    return -EINVALIDINODE;
+  }
+
+  InodeLocks locks(this);
+  locks.lockShared(inodeNumber);
+  inode_t inode;
+  readInode(&super, inodeNumber, &inode);
+  PendingFile file;
+  bool buffered = findPending(inodeNumber, file);
+  if (buffered) {
+    inode.size = file.size;
+  }
+
+  if (size < 0 || offset < 0) {
+    return -EINVALIDSIZE;
+  } else if (offset >= inode.size) {
+    return 0;
+  }
+  size = std::min(size, inode.size - offset);
+  if (size == 0) {
+    return 0;
+  }
+
+  // buffered files are sent out of their buffer and inline data straight
+  // out of the cached inode block
+  if (buffered) {
+    BlockSegment segment;
+    segment.block = file.data;
+    segment.offset = offset;
+    segment.length = size;
+    segments.push_back(segment);
+    return size;
+  } else if (hasInlineData(&super, &inode)) {
+    BlockSegment segment;
+    segment.block = disk->getBlock(super.inode_region_addr + inodeNumber / Geometry::inodesPerBlock);
+    segment.offset = (inodeNumber % Geometry::inodesPerBlock) * sizeof(inode_t) + offsetof(inode_t, direct) + offset;
+    segment.length = size;
+    segments.push_back(segment);
+    return size;
+  }
+
+  int first_block = offset / UFS_BLOCK_SIZE;
+  int last_block = (offset + size - 1) / UFS_BLOCK_SIZE;
+  vector<unsigned int> blocks;
+  readBlockRange(&super, &inode, first_block, last_block - first_block + 1, blocks);
+
+  int bytes_read = 0;
+  segments.reserve(blocks.size());
+  for (size_t i = 0; i < blocks.size(); i++) {
+    BlockSegment segment;
+    segment.block = disk->getBlock(blocks[i]);
+    segment.offset = (offset + bytes_read) % UFS_BLOCK_SIZE;
+    segment.length = std::min(UFS_BLOCK_SIZE - segment.offset, size - bytes_read);
+    segments.push_back(segment);
+    bytes_read += segment.length;
+  }
+
+  return bytes_read;
+}
+
+int LocalFileSystem::create(int parentInodeNumber, int type, string name) {
+  super_t super;
+  readSuperBlock(&super);
+
+  // Checking if parent inode noexistent, not dir, or name is too long
+  if (parentInodeNumber < 0 || parentInodeNumber >= super.num_inodes) {
+    return -EINVALIDINODE;
+  } else if (type != UFS_DIRECTORY && type != UFS_REGULAR_FILE) {
+    return -EINVALIDTYPE;
+  } else if (!name.size() || name.size() > DIR_ENT_NAME_SIZE - 1) {
+    return -EINVALIDNAME;
+  }
+
+  // Nobody can find the new inode until its entry is in the parent, so the
+  // parent's lock covers both of them
+  InodeLocks locks(this);
+  locks.lockExclusive(parentInodeNumber);
+  inode_t parent;
+  readInode(&super, parentInodeNumber, &parent);
+  if (parent.type != UFS_DIRECTORY) {
+    return -EINVALIDTYPE;
+  }
+
+  // checking if name exists and is the right type or not
+  int existing = findEntry(&super, &parent, name);
+  if (existing >= 0) {
+    inode_t existing_inode;
+    readInode(&super, existing, &existing_inode);
+    if (existing_inode.type == type) {
+      return existing;
+    }
+    return -EINVALIDTYPE;
+  }
+
+  BlockMap parent_map;
+  readBlockMap(&super, &parent, parent_map);
+  int parent_blocks = parent_map.blocks.size();
+  int new_parent_blocks = blocksWithEntry(&super, &parent, parent_map, name);
+  if (new_parent_blocks < 0) {
+    return -ENOTENOUGHSPACE;
+  }
+
+  // the free counts catch a full disk without reading the bitmaps
+  pthread_mutex_lock(&inodeAllocatorLock);
+  pthread_mutex_lock(&dataAllocatorLock);
+  int blocks_needed = (type == UFS_DIRECTORY ? 1 : 0) + new_parent_blocks - parent_blocks;
+  if (freeInodes == 0 || availableBlocks() < blocks_needed) {
+    pthread_mutex_unlock(&dataAllocatorLock);
+    pthread_mutex_unlock(&inodeAllocatorLock);
+    return -ENOTENOUGHSPACE;
+  }
+  PagedBitmap inode_bitmap(disk, super.inode_bitmap_addr, super.num_inodes);
+  PagedBitmap data_bitmap(disk, super.data_bitmap_addr, super.num_data);
+
+  // Finding the first free inode, directories also start with a block
+  // holding . and .., and the parent may need to grow. Nothing is written
+  // unless all of them fit.
+  BlockMap new_map;
+  int new_inode_num = inode_bitmap.findClear(0);
+  if (new_inode_num < 0 ||
+      (type == UFS_DIRECTORY && resizeBlockMap(&super, new_map, data_bitmap, 1) < 1) ||
+      resizeBlockMap(&super, parent_map, data_bitmap, new_parent_blocks) < new_parent_blocks) {
+    pthread_mutex_unlock(&dataAllocatorLock);
+    pthread_mutex_unlock(&inodeAllocatorLock);
+    return -ENOTENOUGHSPACE;
+  }
+  inode_bitmap.set(new_inode_num);
+  writeInodeBitmap(&super, inode_bitmap);
+  writeDataBitmap(&super, data_bitmap);
+  pthread_mutex_unlock(&dataAllocatorLock);
+  pthread_mutex_unlock(&inodeAllocatorLock);
+
+  // Everything is allocated, now write it all out
+  inode_t new_inode;
+  memset(&new_inode, 0, sizeof(inode_t));
+  new_inode.type = type;
+  new_inode.size = 0;
+
+  if (type == UFS_DIRECTORY) {
+    dir_ent_t entries[Geometry::entriesPerBlock];
+    clearEntries(entries, Geometry::entriesPerBlock);
+    strcpy(entries[0].name, ".");
+    entries[0].inum = new_inode_num;
+    strcpy(entries[1].name, "..");
+    entries[1].inum = parentInodeNumber;
+    disk->writeBlock(new_map.blocks[0], entries);
+    new_inode.size = hashedDirectories(&super) ? UFS_BLOCK_SIZE : 2 * sizeof(dir_ent_t);
+    writeBlockMap(&super, &new_inode, new_map);
+  }
+
+  addEntry(&super, &parent, parent_map, parent_blocks, name, new_inode_num);
+  writeBlockMap(&super, &parent, parent_map, parent_blocks);
+  int inode_numbers[2] = { new_inode_num, parentInodeNumber };
+  inode_t inodes[2] = { new_inode, parent };
+  writeInodes(&super, 2, inode_numbers, inodes);
+  touchInodes(&super, 2, inode_numbers);
+
+  return new_inode_num;
+}
+
+int LocalFileSystem::write(int inodeNumber, const void *buffer, int size) {
+  const char *data_buffer = static_cast<const char *>(buffer);
+  super_t super;
+  readSuperBlock(&super);
+
+  if (inodeNumber < 0 || inodeNumber >= super.num_inodes) {
+    return -EINVALIDINODE;
+  } else if (size > maxFileSize(&super) || size < 0) {
+    return -EINVALIDSIZE;
+  }
+
+  InodeLocks locks(this);
+  locks.lockExclusive(inodeNumber);
+  inode_t inode;
+  readInode(&super, inodeNumber, &inode);
+
+  if (inode.type != UFS_REGULAR_FILE) {
+    return -EINVALIDTYPE;
+  }
+
+  // the old contents are replaced either way, buffered or not
+  int bytes_written = size;
+  if (!bufferWrite(&super, inodeNumber, &inode, data_buffer, size)) {
+    dropPending(inodeNumber);
+    bytes_written = writeContents(&super, inodeNumber, &inode, data_buffer, size, false, 0);
+  }
+  touchInodes(&super, 1, &inodeNumber);
+
+  return bytes_written;
+}
+
+int LocalFileSystem::writeContents(super_t *super, int inodeNumber, inode_t *inode, const char *data, int size,
+                                   bool flushing, int reserved) {
+  // Reuse the blocks the file already has, then free or allocate the
+  // rest. Small enough files don't need any when they can be inline.
+  int blocks = size / UFS_BLOCK_SIZE;
+  if ((size % UFS_BLOCK_SIZE) != 0) {
+    blocks += 1;
+  }
+  bool inline_data = (super->features & UFS_FEATURE_INLINE_DATA) && size <= UFS_INLINE_DATA_SIZE;
+  if (inline_data) {
+    blocks = 0;
+  }
+  BlockMap map;
+  readBlockMap(super, inode, map);
+  int old_blocks = map.blocks.size();
+  int allocated = old_blocks;
+  if (blocks != old_blocks || reserved > 0) {
+    // blocks reserved for the file become free ones only it can take while
+    // we hold the lock
+    pthread_mutex_lock(&dataAllocatorLock);
+    reservedBlocks -= reserved;
+    if (blocks < old_blocks || (blocks > old_blocks && availableBlocks() > 0)) {
+      PagedBitmap data_bitmap(disk, super->data_bitmap_addr, super->num_data);
+      allocated = resizeBlockMap(super, map, data_bitmap, blocks, flushing);
+      writeDataBitmap(super, data_bitmap);
+    }
+    pthread_mutex_unlock(&dataAllocatorLock);
+  }
+
+  if (inline_data) {
+    memset(inode->direct, 0, sizeof(inode->direct));
+    memcpy(inode->direct, data, size);
+    inode->size = size;
+    writeInode(super, inodeNumber, inode);
+    return size;
+  }
+
+  // if we ran out of space write as much as fits. Reused blocks that
+  // already hold the new contents are skipped.
+  bool dedup = dedupBlocks(super);
+  int bytes_written = std::min(size, allocated * UFS_BLOCK_SIZE);
+  for (int i = 0; i < allocated; i++) {
+    int to_write = std::min(UFS_BLOCK_SIZE, bytes_written - i * UFS_BLOCK_SIZE);
+    char block[UFS_BLOCK_SIZE] = {0};
+    const char *contents = data + i * UFS_BLOCK_SIZE;
+    if (to_write < UFS_BLOCK_SIZE) {
+      memcpy(block, contents, to_write);
+      contents = block;
+    }
+    if (dedup && !storeBlock(super, map, i, contents)) {
+      // no room to copy a shared block, so the file ends before it
+      bytes_written = i * UFS_BLOCK_SIZE;
+      pthread_mutex_lock(&dataAllocatorLock);
+      PagedBitmap data_bitmap(disk, super->data_bitmap_addr, super->num_data);
+      allocated = resizeBlockMap(super, map, data_bitmap, i);
+      writeDataBitmap(super, data_bitmap);
+      pthread_mutex_unlock(&dataAllocatorLock);
+      break;
+    } else if (dedup || (i < old_blocks && blockContains(map.blocks[i], contents))) {
+      continue;
+    }
+    disk->writeBlock(map.blocks[i], (void *) contents);
+  }
+
+  // only the indirect blocks past the old end can have changed, unless
+  // sharing blocks moved some of the pointers before it
+  inode->size = bytes_written;
+  writeBlockMap(super, inode, map, dedup ? 0 : std::min(old_blocks, allocated));
+  writeInode(super, inodeNumber, inode);
+
+  return bytes_written;
+}
+
+int LocalFileSystem::write(int inodeNumber, const void *buffer, int size, int offset) {
+  const char *data_buffer = static_cast<const char *>(buffer);
+  super_t super;
+  readSuperBlock(&super);
+
+  if (inodeNumber < 0 || inodeNumber >= super.num_inodes) {
+    return -EINVALIDINODE;
+  } else if (size < 0 || offset < 0 || size > maxFileSize(&super) - offset) {
+    return -EINVALIDSIZE;
+  }
+
+  InodeLocks locks(this);
+  locks.lockExclusive(inodeNumber);
+  inode_t inode;
+  readInode(&super, inodeNumber, &inode);
+
+  if (inode.type != UFS_REGULAR_FILE) {
+    return -EINVALIDTYPE;
+  } else if (size == 0) {
+    return 0;
+  }
 
-void LocalFileSystem::readInodeBitmap(super_t *super, unsigned char *inodeBitmap) {
-  int bytes_to_read = super->num_inodes / 8;
-  int blocks_to_read = (bytes_to_read + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+  // A buffered file stays buffered if it still fits, otherwise it goes to
+  // disk first and the write carries on from there
+  PendingFile file;
+  if (findPending(inodeNumber, file)) {
+    vector<char> contents(std::max(file.size, offset + size), 0);
+    memcpy(contents.data(), file.data.get(), file.size);
+    memcpy(contents.data() + offset, data_buffer, size);
+    if (bufferWrite(&super, inodeNumber, &inode, contents.data(), contents.size())) {
+      touchInodes(&super, 1, &inodeNumber);
+      return size;
+    }
+    int ret = flushPending(&super, inodeNumber, &inode);
+    if (ret < 0) {
+      return ret;
+    }
+  }
 
-  for (int i = 0; i < blocks_to_read; i++) {
-    char local_buffer[UFS_BLOCK_SIZE];
-    disk->readBlock(super->inode_bitmap_addr + i, local_buffer);
+  int old_size = inode.size;
+  int end = offset + size;
+  int first_block = offset / UFS_BLOCK_SIZE;
+  bool dedup = dedupBlocks(&super);
+  vector<unsigned int> blocks;
+  BlockMap map;
+
+  // Inline files that stay small only change the inode. Ones that outgrow
+  // it keep their old bytes at the start of their first block.
+  bool was_inline = hasInlineData(&super, &inode);
+  char inline_data[UFS_INLINE_DATA_SIZE];
+  if (was_inline && end <= UFS_INLINE_DATA_SIZE) {
+    memcpy((char *) inode.direct + offset, data_buffer, size);
+    inode.size = std::max(old_size, end);
+    writeInode(&super, inodeNumber, &inode);
+    touchInodes(&super, 1, &inodeNumber);
+    return size;
+  } else if (was_inline) {
+    memcpy(inline_data, inode.direct, old_size);
+  }
 
-    int copy_size = std::min(UFS_BLOCK_SIZE, bytes_to_read - (i * UFS_BLOCK_SIZE));
-    memcpy(inodeBitmap + (i * UFS_BLOCK_SIZE), local_buffer, copy_size);
+  if (end > old_size) {
+    // Growing the file: the gap from the old end up to offset gets zeroed too
+    readBlockMap(&super, &inode, map);
+    int new_blocks = end / UFS_BLOCK_SIZE;
+    if ((end % UFS_BLOCK_SIZE) != 0) {
+      new_blocks += 1;
+    }
+    int allocated = map.blocks.size();
+    pthread_mutex_lock(&dataAllocatorLock);
+    if (new_blocks > allocated && availableBlocks() > 0) {
+      PagedBitmap data_bitmap(disk, super.data_bitmap_addr, super.num_data);
+      allocated = resizeBlockMap(&super, map, data_bitmap, new_blocks);
+      if (std::min(end, allocated * UFS_BLOCK_SIZE) > offset) {
+        writeDataBitmap(&super, data_bitmap);
+      }
+    }
+    pthread_mutex_unlock(&dataAllocatorLock);
+    end = std::min(end, allocated * UFS_BLOCK_SIZE);
+    if (end <= offset) {
+      return 0;
+    }
+    first_block = std::min(first_block, old_size / UFS_BLOCK_SIZE);
+    blocks.assign(map.blocks.begin() + first_block, map.blocks.end());
+  } else if (dedup) {
+    // storing blocks can move their pointers, so it needs the whole map
+    int last_block = (end - 1) / UFS_BLOCK_SIZE;
+    readBlockMap(&super, &inode, map);
+    blocks.assign(map.blocks.begin() + first_block, map.blocks.begin() + last_block + 1);
+  } else {
+    int last_block = (end - 1) / UFS_BLOCK_SIZE;
+    readBlockRange(&super, &inode, first_block, last_block - first_block + 1, blocks);
   }
-}
 
-void LocalFileSystem::writeInodeBitmap(super_t *super, unsigned char *inodeBitmap) {
-  int bytes_to_write = super->num_inodes / 8;
-  int blocks_to_write = (bytes_to_write + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+  int stored = blocks.size();
+  for (size_t i = 0; i < blocks.size(); i++) {
+    int block_start = (first_block + i) * UFS_BLOCK_SIZE;
+    int copy_start = std::max(offset, block_start);
+    int copy_end = std::min(end, block_start + UFS_BLOCK_SIZE);
 
-  for (int i = 0; i < blocks_to_write; i++) {
-    char local_buffer[UFS_BLOCK_SIZE];
-    int copy_size = std::min(UFS_BLOCK_SIZE, bytes_to_write - (i * UFS_BLOCK_SIZE));
-    memcpy(local_buffer, inodeBitmap + (i * UFS_BLOCK_SIZE), copy_size);
+    if (copy_start == block_start && copy_end == block_start + UFS_BLOCK_SIZE) {
+      const char *contents = data_buffer + copy_start - offset;
+      if (dedup && !storeBlock(&super, map, first_block + i, contents)) {
+        stored = i;
+        break;
+      } else if (!dedup && (block_start >= old_size || was_inline || !blockContains(blocks[i], contents))) {
+        disk->writeBlock(blocks[i], (void *) contents);
+      }
+      continue;
+    }
+
+    // keep the old bytes that are still inside the file, zero the rest
+    char block[UFS_BLOCK_SIZE] = {0};
+    if (was_inline) {
+      if (block_start == 0) {
+        memcpy(block, inline_data, old_size);
+      }
+    } else if (block_start < old_size) {
+      disk->readBlock(blocks[i], block);
+      int valid = old_size - block_start;
+      if (valid < UFS_BLOCK_SIZE) {
+        memset(block + valid, 0, UFS_BLOCK_SIZE - valid);
+      }
+    }
+    if (copy_start < copy_end) {
+      memcpy(block + copy_start - block_start, data_buffer + copy_start - offset, copy_end - copy_start);
+    }
+    if (dedup && !storeBlock(&super, map, first_block + i, block)) {
+      stored = i;
+      break;
+    } else if (!dedup) {
+      disk->writeBlock(blocks[i], block);
+    }
+  }
 
-    disk->writeBlock(super->inode_bitmap_addr + i, local_buffer);
+  int old_blocks = old_size / UFS_BLOCK_SIZE;
+  if ((old_size % UFS_BLOCK_SIZE) != 0 && !was_inline) {
+    old_blocks += 1;
+  }
+  if (stored < (int) blocks.size()) {
+    // Only shared blocks need a new one to write, and those are all before
+    // the old end of the file. It keeps its size and gives back any blocks
+    // it grew by.
+    end = std::min(end, (first_block + stored) * UFS_BLOCK_SIZE);
+    pthread_mutex_lock(&dataAllocatorLock);
+    PagedBitmap data_bitmap(disk, super.data_bitmap_addr, super.num_data);
+    resizeBlockMap(&super, map, data_bitmap, old_blocks);
+    writeDataBitmap(&super, data_bitmap);
+    pthread_mutex_unlock(&dataAllocatorLock);
+    writeBlockMap(&super, &inode, map, first_block);
+    writeInode(&super, inodeNumber, &inode);
+    touchInodes(&super, 1, &inodeNumber);
+    return std::max(0, end - offset);
   }
-}
 
-void LocalFileSystem::readDataBitmap(super_t *super, unsigned char *dataBitmap) {
-  char local_buffer[UFS_BLOCK_SIZE];
-  disk->readBlock(super->data_bitmap_addr, local_buffer);
-  memcpy(dataBitmap, local_buffer, super->num_data / 8);
+  if (end > old_size || dedup) {
+    inode.size = std::max(old_size, end);
+    writeBlockMap(&super, &inode, map, dedup ? first_block : old_blocks);
+    writeInode(&super, inodeNumber, &inode);
+  }
+  touchInodes(&super, 1, &inodeNumber);
+
+  return end - offset;
 }
 
-void LocalFileSystem::writeDataBitmap(super_t *super, unsigned char *dataBitmap) {
-  char local_buffer[UFS_BLOCK_SIZE];
-  memcpy(local_buffer, dataBitmap, super->num_data / 8);
-  disk->writeBlock(super->data_bitmap_addr, local_buffer);
+int LocalFileSystem::availableBlocks(PagedBitmap *dataBitmap) {
+  return freeBlocks - reservedBlocks - (dataBitmap != NULL ? dataBitmap->added() : 0);
 }
 
-void LocalFileSystem::readInodeRegion(super_t *super, inode_t *inodes) {
-  int inodes_per_block = UFS_BLOCK_SIZE / sizeof(inode_t);
-  // Read for each inode
-  for (int i = 0; i < super->num_inodes; i++) {
-    char local_buffer[UFS_BLOCK_SIZE];
-    int block_offset = i / inodes_per_block;
-    int inode_offset = i % inodes_per_block;
-    disk->readBlock(super->inode_region_addr + block_offset, local_buffer);
-    memcpy(&inodes[i], (sizeof(inode_t) * inode_offset) + local_buffer, sizeof(inode_t));
+int LocalFileSystem::blocksFor(super_t *super, int size) {
+  if ((super->features & UFS_FEATURE_INLINE_DATA) && size <= UFS_INLINE_DATA_SIZE) {
+    return 0;
+  }
+  int blocks = size / UFS_BLOCK_SIZE;
+  if ((size % UFS_BLOCK_SIZE) != 0) {
+    blocks += 1;
   }
+  return blocks + pointerBlocksNeeded(super, blocks);
 }
 
-void LocalFileSystem::writeInodeRegion(super_t *super, inode_t *inodes) {
-  int inodes_per_block = UFS_BLOCK_SIZE / sizeof(inode_t);
+void LocalFileSystem::setDelayedAllocation(bool enabled) {
+  delayedAllocation = enabled;
+}
 
-  for (int block_index = 0; block_index < super->inode_region_len; block_index++) {
-    char local_buffer[UFS_BLOCK_SIZE];
-    int start_inode = block_index * inodes_per_block;
-    int end_inode = std::min(start_inode + inodes_per_block, super->num_inodes);
+bool LocalFileSystem::bufferWrite(super_t *super, int inodeNumber, inode_t *inode, const char *contents,
+                                  int size) {
+  if (!delayedAllocation || dedupBlocks(super) || size > DELAYED_ALLOCATION_FILE_SIZE) {
+    return false;
+  }
+  unsigned char *copy = new unsigned char[size];
+  memcpy(copy, contents, size);
+  PendingFile file;
+  file.data = BlockBuffer(copy, default_delete<unsigned char[]>());
+  file.size = size;
+  // the blocks the file has on disk get reused when it's flushed
+  file.reservedBlocks = std::max(0, blocksFor(super, size) - blocksFor(super, inode->size));
+
+  pthread_mutex_lock(&dataAllocatorLock);
+  pthread_mutex_lock(&pendingLock);
+  int old_size = 0;
+  int old_reserved = 0;
+  map<int, PendingFile>::iterator old = pending.find(inodeNumber);
+  if (old != pending.end()) {
+    old_size = old->second.size;
+    old_reserved = old->second.reservedBlocks;
+  }
+  bool fits = pendingBytes - old_size + size <= DELAYED_ALLOCATION_BUFFER_SIZE &&
+              file.reservedBlocks - old_reserved <= availableBlocks();
+  if (fits) {
+    pending[inodeNumber] = file;
+    pendingBytes += size - old_size;
+    reservedBlocks += file.reservedBlocks - old_reserved;
+  }
+  pthread_mutex_unlock(&pendingLock);
+  pthread_mutex_unlock(&dataAllocatorLock);
+  return fits;
+}
 
-    memcpy(local_buffer, &inodes[start_inode], (end_inode - start_inode) * sizeof(inode_t));
-    disk->writeBlock(super->inode_region_addr + block_index, local_buffer);
+bool LocalFileSystem::findPending(int inodeNumber, PendingFile &file) {
+  if (!delayedAllocation) {
+    return false;
   }
+  pthread_mutex_lock(&pendingLock);
+  map<int, PendingFile>::iterator iter = pending.find(inodeNumber);
+  bool found = iter != pending.end();
+  if (found) {
+    file = iter->second;
+  }
+  pthread_mutex_unlock(&pendingLock);
+  return found;
 }
 
-int LocalFileSystem::lookup(int parentInodeNumber, string name) {
-  char local_buffer[UFS_BLOCK_SIZE];
-  inode_t inode;
+int LocalFileSystem::flushPending(super_t *super, int inodeNumber, inode_t *inode) {
+  PendingFile file;
+  if (!findPending(inodeNumber, file)) {
+    return 0;
+  }
 
-  // checking if name even exists or invalid parent inode
-  if (stat(parentInodeNumber, &inode) < 0) {
-    return -ENOTFOUND;
-  } else if (inode.type != UFS_DIRECTORY) {
-    return -EINVALIDINODE;
+  // writeContents takes over the file's reservation. If it comes up short
+  // the file stays buffered, with nothing reserved now, so no data is lost.
+  int bytes_written = writeContents(super, inodeNumber, inode, (const char *) file.data.get(), file.size,
+                                    true, file.reservedBlocks);
+  pthread_mutex_lock(&pendingLock);
+  map<int, PendingFile>::iterator iter = pending.find(inodeNumber);
+  if (bytes_written < file.size) {
+    iter->second.reservedBlocks = 0;
+  } else {
+    pending.erase(iter);
+    pendingBytes -= file.size;
   }
+  pthread_mutex_unlock(&pendingLock);
+  return bytes_written < file.size ? -ENOTENOUGHSPACE : 0;
+}
 
-  for (int i = 0; i < DIRECT_PTRS; i++) {
-    if (inode.direct[i] > 0 && inode.direct[i] < MAX_FILE_SIZE) {
-      disk->readBlock(inode.direct[i], local_buffer);
-      dir_ent_t entry;
-
-      for (size_t N = 0; N < UFS_BLOCK_SIZE / sizeof(dir_ent_t); N++) {
-        memcpy(&entry, local_buffer + N * sizeof(dir_ent_t), sizeof(dir_ent_t));
-        if (std::strcmp(entry.name, name.c_str()) == 0) {
-          return entry.inum;
-        }
-      }
-    } else {
-      return -EINVALIDINODE; // couldn't find anything matching the name
-    }
+void LocalFileSystem::dropPending(int inodeNumber) {
+  if (!delayedAllocation) {
+    return;
   }
-  
-  return -ENOTFOUND;
+  pthread_mutex_lock(&dataAllocatorLock);
+  pthread_mutex_lock(&pendingLock);
+  map<int, PendingFile>::iterator iter = pending.find(inodeNumber);
+  if (iter != pending.end()) {
+    reservedBlocks -= iter->second.reservedBlocks;
+    pendingBytes -= iter->second.size;
+    pending.erase(iter);
+  }
+  pthread_mutex_unlock(&pendingLock);
+  pthread_mutex_unlock(&dataAllocatorLock);
 }
 
-int LocalFileSystem::stat(int inodeNumber, inode_t *inode) {
+int LocalFileSystem::flush(int inodeNumber) {
   super_t super;
   readSuperBlock(&super);
 
@@ -121,163 +1741,122 @@ int LocalFileSystem::stat(int inodeNumber, inode_t *inode) {
     return -EINVALIDINODE;
   }
 
-  inode_t inodeTable[super.num_inodes];
-  readInodeRegion(&super, inodeTable);
-  *inode = inodeTable[inodeNumber];
-
-  return 0;
+  InodeLocks locks(this);
+  locks.lockExclusive(inodeNumber);
+  inode_t inode;
+  readInode(&super, inodeNumber, &inode);
+  return flushPending(&super, inodeNumber, &inode);
 }
 
-int LocalFileSystem::read(int inodeNumber, void *buffer, int size) {
-  char *data_buffer = static_cast<char *>(buffer);
+int LocalFileSystem::discard(int inodeNumber) {
   super_t super;
   readSuperBlock(&super);
 
-  // Check for valid inode #
   if (inodeNumber < 0 || inodeNumber >= super.num_inodes) {
     return -EINVALIDINODE;
   }
-  
-  inode_t inodeTable[super.num_inodes];
-  readInodeRegion(&super, inodeTable);
-  inode_t inode = inodeTable[inodeNumber];
 
-  // size is valid?
-  if (size <= 0 || size > inode.size) {
-    return -EINVALIDSIZE;
-  }
+  InodeLocks locks(this);
+  locks.lockExclusive(inodeNumber);
+  dropPending(inodeNumber);
+  return 0;
+}
 
-  int blocks = inode.size / UFS_BLOCK_SIZE;
-  if ((inode.size % UFS_BLOCK_SIZE) != 0) {
-    blocks += 1;
+int LocalFileSystem::sync() {
+  vector<int> inode_numbers;
+  pthread_mutex_lock(&pendingLock);
+  map<int, PendingFile>::iterator iter;
+  for (iter = pending.begin(); iter != pending.end(); iter++) {
+    inode_numbers.push_back(iter->first);
   }
+  pthread_mutex_unlock(&pendingLock);
 
-  // Read the data into the buffer
-  int bytes_read = 0;
-  int to_read = 0;
-  int block_to_read = size / UFS_BLOCK_SIZE;
-  // cout << "inode dir: " << inode.direct[i] << "and blocks: " << blocks << endl;
-  if (inode.direct[block_to_read] != 0) {
-    char block[UFS_BLOCK_SIZE];
-    to_read = std::min(UFS_BLOCK_SIZE, size - bytes_read);
-    disk->readBlock(inode.direct[block_to_read], block);
-    memcpy(data_buffer, block, to_read);
-    bytes_read += to_read;
+  // files written in the meantime are left for the next sync
+  for (size_t i = 0; i < inode_numbers.size(); i++) {
+    int ret = flush(inode_numbers[i]);
+    if (ret < 0) {
+      return ret;
+    }
   }
-
-  return bytes_read;
+  return inode_numbers.size();
 }
 
-int LocalFileSystem::create(int parentInodeNumber, int type, string name) {
-  char local_buffer[UFS_BLOCK_SIZE];
-  inode_t inode;
-
-  int check_stat = stat(parentInodeNumber, &inode);
-  int new_inode_num = -1;
- 
-
+int LocalFileSystem::readdir(int inodeNumber, vector<dir_ent_t> &entries, int count, long &cookie) {
   super_t super;
   readSuperBlock(&super);
-  
-  inode_t inodeTable[super.num_inodes];
-  readInodeRegion(&super, inodeTable);
-
-  unsigned char bitmap[super.num_inodes / 8];
-  readInodeBitmap(&super, bitmap);
+  entries.clear();
 
-  unsigned char data_bitmap[super.num_data / 8];
-  readDataBitmap(&super, data_bitmap);
-
-  unsigned char inode_bitmap[super.num_inodes / 8];
-  readInodeBitmap(&super, inode_bitmap);
-
-  // Checking if parent inode noexistent, not dir, or name is too long
-  if (parentInodeNumber < 0 || parentInodeNumber >= super.num_inodes || check_stat < 0) {
+  if (inodeNumber < 0 || inodeNumber >= super.num_inodes) {
     return -EINVALIDINODE;
-  } else if (inode.type != UFS_DIRECTORY) {
-    return -EINVALIDTYPE;
-  } else if (name.size() > DIR_ENT_NAME_SIZE - 1) {
-    return -EINVALIDNAME;
+  } else if (count < 0 || cookie < 0) {
+    return -EINVALIDSIZE;
   }
 
-  // checking if name exists and is the right type or not
-  int blocks = inode.size / UFS_BLOCK_SIZE;
-  if ((inode.size % UFS_BLOCK_SIZE) != 0) {
-    blocks += 1;
+  InodeLocks locks(this);
+  locks.lockShared(inodeNumber);
+  inode_t inode;
+  readInode(&super, inodeNumber, &inode);
+  if (inode.type != UFS_DIRECTORY) {
+    return -EINVALIDINODE;
+  } else if (count == 0) {
+    return 0;
   }
 
-  for (int i = 0; i < blocks; i++) {
-    if (inode.direct[i] >= 0 && inode.direct[i] < (unsigned)disk->numberOfBlocks()) {
-      disk->readBlock(inode.direct[i], local_buffer);
-      dir_ent_t cur_entry;
-      
-      for (size_t N = 0; N < inode.size / sizeof(dir_ent_t); N++) {
-        memcpy(&cur_entry, local_buffer + N * sizeof(dir_ent_t), sizeof(dir_ent_t));
-        if (std::strcmp(cur_entry.name, name.c_str()) == 0) {
-          if (inodeTable[cur_entry.inum].type == type) {
-            return cur_entry.inum;
-          } else {
-            return -EINVALIDTYPE;
-          }
+  dir_ent_t block[Geometry::entriesPerBlock];
+  vector<unsigned int> block_number;
+
+  // flat directories: the cookie is the index of the next entry
+  if (!hashedDirectories(&super)) {
+    long num_entries = inode.size / sizeof(dir_ent_t);
+    while (cookie < num_entries && (int) entries.size() < count) {
+      readBlockRange(&super, &inode, cookie / Geometry::entriesPerBlock, 1, block_number);
+      disk->readBlock(block_number[0], block);
+      for (int N = cookie % Geometry::entriesPerBlock;
+           N < Geometry::entriesPerBlock && cookie < num_entries && (int) entries.size() < count; N++, cookie++) {
+        if (block[N].name[0] != '\0') {
+          entries.push_back(block[N]);
         }
       }
     }
+    return entries.size();
   }
 
-  // Finding the first free inode, and setting it up
-  // for (int i = 0; i < super.num_inodes; i++) {
-  //   if ( !(inode_bitmap[i / 8] & (1 << (i % 8))) ) {
-  //     new_inode_num = i;
-  //     inode_bitmap[i / 8] |= (1 << (i % 8));
-  //     break;
-  //   }
-  // }
-  // if (new_inode_num < 0) {
-  //   return -ENOTENOUGHSPACE;
-  // }
-
-
-  return new_inode_num;
-}
-
-int LocalFileSystem::write(int inodeNumber, const void *buffer, int size) {
-  super_t super;
-  readSuperBlock(&super);
-
-  unsigned char data_buffer[super.num_data / 8];
-  inode_t inode;
-  inode_t inodeTable[super.num_inodes];
-  int bytes_left = -1;
-  int parent_inum = stat(inodeNumber, &inode);
-  // cout << parent_inum << endl;
-  // cout << inode.type << endl;
-
-  // int blocks = size / UFS_BLOCK_SIZE;
-  // if ((size % UFS_BLOCK_SIZE) != 0) {
-  //   blocks += 1;
-  // }
-
-  if (inodeNumber < 0 || inodeNumber >= super.num_inodes) {
-    return -EINVALIDINODE;
-  } else if (size > MAX_FILE_SIZE || size <= 0) {
-    return -EINVALIDSIZE;
-  } else if (parent_inum < 0) {
-    return -EINVALIDINODE;
+  // Hashed directories: cookies 0 and 1 are . and .., which come first in
+  // block 0, and cookie 2 + h continues with the entries whose hash is at
+  // least h. A page never ends between two entries with the same hash.
+  int blocks = inode.size / UFS_BLOCK_SIZE;
+  readBlockRange(&super, &inode, 0, 1, block_number);
+  disk->readBlock(block_number[0], block);
+  while (cookie < 2 && (int) entries.size() < count) {
+    entries.push_back(block[cookie]);
+    cookie++;
   }
-
-  if (inode.type == UFS_DIRECTORY) {
-    return -EINVALIDTYPE;
+  if ((int) entries.size() == count || cookie - 2 > 0xffffffffL) {
+    return entries.size();
   }
 
-  readInodeRegion(&super, inodeTable);
-  // inode = inodeTable[inodeNumber];
-
-  readDataBitmap(&super, data_buffer);
-  //const char *block_buffer = static_cast<const char*>(buffer);
-//  char local_buffer[UFS_BLOCK_SIZE];
-
-
-  return bytes_left;
+  unsigned int min_hash = cookie - 2;
+  unsigned int last_hash = 0;
+  for (int i = hashBlock(min_hash, blocks); i < blocks; i++) {
+    readBlockRange(&super, &inode, i, 1, block_number);
+    disk->readBlock(block_number[0], block);
+    for (int N = 0; N < Geometry::entriesPerBlock && block[N].name[0] != '\0'; N++) {
+      if (strcmp(block[N].name, ".") == 0 || strcmp(block[N].name, "..") == 0) {
+        continue;
+      }
+      unsigned int hash = nameHash(block[N].name);
+      if (hash < min_hash) {
+        continue;
+      } else if ((int) entries.size() >= count && hash != last_hash) {
+        cookie = 2 + (long) hash;
+        return entries.size();
+      }
+      entries.push_back(block[N]);
+      last_hash = hash;
+    }
+  }
+  cookie = 2 + 0x100000000L;
+  return entries.size();
 }
 
 /*
@@ -292,11 +1871,8 @@ Steps (for my own refernce):
   5. Set bitmaps and write them back into the disk
 */
 int LocalFileSystem::unlink(int parentInodeNumber, string name) {
-  inode_t inode;
-  inode_t inode_from_lookup;
   super_t super;
   readSuperBlock(&super);
-  int parent_inum = lookup(parentInodeNumber, name);
 
   // Check valid parent inode, valid name, and if unlink is allowed
   if (parentInodeNumber < 0 || parentInodeNumber >= super.num_inodes) {
@@ -307,104 +1883,419 @@ int LocalFileSystem::unlink(int parentInodeNumber, string name) {
     return -EUNLINKNOTALLOWED;
   }
 
-  inode_t inodeTable[super.num_inodes];
-  readInodeRegion(&super, inodeTable);
+  // The child is only known once the parent is locked. When the child's
+  // lock comes first in the lock order, drop the parent's, take both in
+  // order and look the name up again in case it changed in between.
+  InodeLocks locks(this);
+  inode_t inode;
+  int child_inum = -1;
+  while (true) {
+    locks.lockExclusive(parentInodeNumber, child_inum);
+    readInode(&super, parentInodeNumber, &inode);
+    if (inode.type != UFS_DIRECTORY) {
+      return -EINVALIDINODE;
+    }
 
-  if (parent_inum >= super.num_inodes) {
-    return -EINVALIDINODE;
+    // the name not existing is not an error
+    int found = findEntry(&super, &inode, name);
+    if (found == -ENOTFOUND) {
+      return 0;
+    } else if (found < 0 || found >= super.num_inodes) {
+      return -EINVALIDINODE;
+    } else if (found == child_inum) {
+      break;
+    } else if (inodeLock(found) >= inodeLock(parentInodeNumber)) {
+      locks.lockExclusive(found);
+      child_inum = found;
+      break;
+    }
+    locks.unlock();
+    child_inum = found;
   }
 
-  inode = inodeTable[parentInodeNumber]; 
-  // cout << parent_inum << " " << inode.size << endl;
-  if (inode.type != UFS_DIRECTORY) {
-    return -EINVALIDTYPE;
-  } 
-  
-  inode_from_lookup = inodeTable[parent_inum];
-  // cout << inode_from_lookup.size << endl;
-
-  
-  if (inode_from_lookup.type == UFS_DIRECTORY && (long unsigned int)inode_from_lookup.size > 2 * sizeof(dir_ent_t)) {
+  inode_t inode_from_lookup;
+  readInode(&super, child_inum, &inode_from_lookup);
+  if (inode_from_lookup.type == UFS_DIRECTORY && !directoryIsEmpty(&super, &inode_from_lookup)) {
     return -EDIRNOTEMPTY;
-  } else if ((long unsigned int)inode_from_lookup.size == 2 * sizeof(dir_ent_t) && parent_inum < 0) {
-    return -EINVALIDINODE;
-  } else if (parent_inum < 0) {
-    return 0;
-  } else if (parent_inum > 0 && inode.size == 0) {
-    return -EINVALIDINODE;
   }
 
-  if (inode_from_lookup.size == 0 && inode_from_lookup.type == UFS_DIRECTORY) {
+  BlockMap map;
+  readBlockMap(&super, &inode, map);
+  int blocks = removeEntry(&super, &inode, map, name);
+
+  // free the parent's emptied block, the child's data and indirect blocks
+  // and the child's inode. The inodes are written before the bitmaps so a
+  // create can't be handed the child's inode while we still write to it.
+  BlockMap child_map;
+  readBlockMap(&super, &inode_from_lookup, child_map);
+  dropPending(child_inum);
+
+  pthread_mutex_lock(&inodeAllocatorLock);
+  pthread_mutex_lock(&dataAllocatorLock);
+  PagedBitmap inode_bitmap(disk, super.inode_bitmap_addr, super.num_inodes);
+  PagedBitmap data_bitmap(disk, super.data_bitmap_addr, super.num_data);
+  resizeBlockMap(&super, map, data_bitmap, blocks);
+  resizeBlockMap(&super, child_map, data_bitmap, 0);
+  inode_bitmap.clear(child_inum);
+
+  writeBlockMap(&super, &inode, map);
+  memset(&inode_from_lookup, 0, sizeof(inode_t));
+  int inode_numbers[2] = { parentInodeNumber, child_inum };
+  inode_t inodes[2] = { inode, inode_from_lookup };
+  writeInodes(&super, 2, inode_numbers, inodes);
+  touchInodes(&super, 2, inode_numbers);
+
+  writeInodeBitmap(&super, inode_bitmap);
+  writeDataBitmap(&super, data_bitmap);
+  pthread_mutex_unlock(&dataAllocatorLock);
+  pthread_mutex_unlock(&inodeAllocatorLock);
+
+  return 0;
+}
+
+int LocalFileSystem::rename(int srcParentInodeNumber, string srcName,
+                            int dstParentInodeNumber, string dstName) {
+  super_t super;
+  readSuperBlock(&super);
+
+  if (srcParentInodeNumber < 0 || srcParentInodeNumber >= super.num_inodes ||
+      dstParentInodeNumber < 0 || dstParentInodeNumber >= super.num_inodes) {
     return -EINVALIDINODE;
+  } else if (!srcName.size() || srcName.size() > DIR_ENT_NAME_SIZE - 1 ||
+             !dstName.size() || dstName.size() > DIR_ENT_NAME_SIZE - 1) {
+    return -EINVALIDNAME;
+  } else if (srcName == "." || srcName == ".." || dstName == "." || dstName == "..") {
+    return -EINVALIDNAME;
   }
-  
-  unsigned char inode_bitmap[super.num_inodes / 8];
-  readInodeBitmap(&super, inode_bitmap);
-
-  unsigned char data_bitmap[super.num_data / 8];
-  readDataBitmap(&super, data_bitmap);
 
-  int blocks = inode.size / UFS_BLOCK_SIZE;
-  if ((inode.size % UFS_BLOCK_SIZE) != 0) {
-    blocks += 1;
+  // Only renames between directories can change a directory's ancestors.
+  // Taking turns on those keeps two of them from each moving a directory
+  // under the other one.
+  if (srcParentInodeNumber == dstParentInodeNumber) {
+    return renameEntry(&super, srcParentInodeNumber, srcName, dstParentInodeNumber, dstName);
   }
+  pthread_mutex_lock(&renameLock);
+  int ret = renameEntry(&super, srcParentInodeNumber, srcName, dstParentInodeNumber, dstName);
+  pthread_mutex_unlock(&renameLock);
+  return ret;
+}
 
-  char local_buffer[UFS_BLOCK_SIZE * blocks];
-  bool is_removed = false;
+int LocalFileSystem::renameEntry(super_t *super, int srcParentInodeNumber, string srcName,
+                                 int dstParentInodeNumber, string dstName) {
+  // Like unlink, the source and any existing destination are only known
+  // once the parents are locked, so lock everything in order and look
+  // both names up again until they stop changing.
+  bool same_parent = srcParentInodeNumber == dstParentInodeNumber;
+  inode_t parents[2];
+  inode_t *src_parent = &parents[0];
+  inode_t *dst_parent = same_parent ? &parents[0] : &parents[1];
+  InodeLocks locks(this);
+  int src_inum = -1;
+  int dst_inum = -1;
+  while (true) {
+    int inode_numbers[4] = { srcParentInodeNumber, dstParentInodeNumber, src_inum, dst_inum };
+    locks.lockExclusive(4, inode_numbers);
+    readInode(super, srcParentInodeNumber, src_parent);
+    if (!same_parent) {
+      readInode(super, dstParentInodeNumber, dst_parent);
+    }
+    // a removed directory is zeroed, which reads as a directory with no
+    // entries, not even . and ..
+    if (src_parent->type != UFS_DIRECTORY || dst_parent->type != UFS_DIRECTORY ||
+        src_parent->size == 0 || dst_parent->size == 0) {
+      return -EINVALIDINODE;
+    }
 
-  for (int i = 0; i < DIRECT_PTRS; i++) {
-    if (is_removed) {
+    int found_src = findEntry(super, src_parent, srcName);
+    int found_dst = findEntry(super, dst_parent, dstName);
+    if (found_src == -ENOTFOUND) {
+      return -ENOTFOUND;
+    } else if (found_dst == -ENOTFOUND) {
+      found_dst = -1;
+    }
+    if (found_src < 0 || found_src >= super->num_inodes || found_dst >= super->num_inodes ||
+        found_dst < -1) {
+      return -EINVALIDINODE;
+    } else if (found_src == src_inum && found_dst == dst_inum) {
       break;
     }
-    if (inode.direct[i] <= 0 || (int)inode.direct[i] >= super.num_data + super.data_region_addr) {
-      continue; 
-    }
-
-    disk->readBlock(inode.direct[i], local_buffer);
-    for (size_t N = 0; N < UFS_BLOCK_SIZE / sizeof(dir_ent_t); N++) {
-      dir_ent_t cur_entry;
-      memcpy(&cur_entry, local_buffer + N * sizeof(dir_ent_t), sizeof(dir_ent_t));
-      
-      if (cur_entry.inum == parent_inum) {
-        // clear cur_entry, also shift everything for deletion
-        for (size_t M = N; M < (inode.size / sizeof(dir_ent_t)) - 1; M++) {
-          dir_ent_t shift_entry;
-          memcpy(&shift_entry, local_buffer + (M + 1) * sizeof(dir_ent_t), sizeof(dir_ent_t));
-          memcpy(local_buffer + M * sizeof(dir_ent_t), &shift_entry, sizeof(dir_ent_t));
-        }
-        dir_ent_t clear_entry;
-        memcpy(local_buffer + ((inode.size / sizeof(dir_ent_t)) - 1) * sizeof(dir_ent_t), &clear_entry, sizeof(dir_ent_t));
-        disk->writeBlock(inode.direct[i], local_buffer);
-        is_removed = true;
-        break;
+    locks.unlock();
+    src_inum = found_src;
+    dst_inum = found_dst;
+  }
+
+  if (src_inum == dst_inum) {
+    return 0;
+  }
+
+  inode_t src;
+  readInode(super, src_inum, &src);
+
+  // a directory can't move into itself, so walk up from the new parent
+  // through .. and make sure we never pass it
+  if (src.type == UFS_DIRECTORY && !same_parent) {
+    dir_ent_t entries[Geometry::entriesPerBlock];
+    int ancestor = dstParentInodeNumber;
+    while (ancestor != UFS_ROOT_DIRECTORY_INODE_NUMBER) {
+      if (ancestor == src_inum) {
+        return -EINVALIDINODE;
       }
+      inode_t inode;
+      vector<unsigned int> block;
+      readInode(super, ancestor, &inode);
+      readBlockRange(super, &inode, 0, 1, block);
+      disk->readBlock(block[0], entries);
+      ancestor = entries[1].inum;
     }
   }
 
-  inode_from_lookup.type = 0; 
-  inode_from_lookup.size = 0;
-  
-  for (int i = 0; i < DIRECT_PTRS; i++) {
-    if (inode_from_lookup.direct[i] > 0) {
-      int cur_block = inode_from_lookup.direct[i] - super.data_region_addr;
-      if (cur_block >= 0 && cur_block < super.num_data) {
-        data_bitmap[cur_block / 8] &= ~(1 << (cur_block % 8));
-        inode_from_lookup.direct[i] = 0; 
+  inode_t dst;
+  if (dst_inum >= 0) {
+    readInode(super, dst_inum, &dst);
+    if (dst.type != src.type) {
+      return -EINVALIDTYPE;
+    } else if (dst.type == UFS_DIRECTORY && !directoryIsEmpty(super, &dst)) {
+      return -EDIRNOTEMPTY;
+    }
+  }
+
+  BlockMap src_map;
+  BlockMap dst_map_storage;
+  readBlockMap(super, src_parent, src_map);
+  BlockMap &dst_map = same_parent ? src_map : dst_map_storage;
+  if (!same_parent) {
+    readBlockMap(super, dst_parent, dst_map);
+  }
+  int src_blocks = src_map.blocks.size();
+  int dst_blocks = dst_map.blocks.size();
+
+  // A new destination entry may need the directory to grow, nothing is
+  // written unless it can
+  if (dst_inum < 0) {
+    int new_dst_blocks = blocksWithEntry(super, dst_parent, dst_map, dstName);
+    if (new_dst_blocks < 0) {
+      return -ENOTENOUGHSPACE;
+    } else if (new_dst_blocks > dst_blocks) {
+      pthread_mutex_lock(&dataAllocatorLock);
+      if (availableBlocks() < new_dst_blocks - dst_blocks) {
+        pthread_mutex_unlock(&dataAllocatorLock);
+        return -ENOTENOUGHSPACE;
       }
+      PagedBitmap data_bitmap(disk, super->data_bitmap_addr, super->num_data);
+      if (resizeBlockMap(super, dst_map, data_bitmap, new_dst_blocks) < new_dst_blocks) {
+        pthread_mutex_unlock(&dataAllocatorLock);
+        return -ENOTENOUGHSPACE;
+      }
+      writeDataBitmap(super, data_bitmap);
+      pthread_mutex_unlock(&dataAllocatorLock);
     }
+    addEntry(super, dst_parent, dst_map, dst_blocks, dstName, src_inum);
+  } else {
+    replaceEntry(super, dst_parent, dst_map, dstName, src_inum);
+  }
+  int blocks = removeEntry(super, src_parent, src_map, srcName);
+
+  // a moved directory's .. follows it
+  if (src.type == UFS_DIRECTORY && !same_parent) {
+    dir_ent_t entries[Geometry::entriesPerBlock];
+    vector<unsigned int> block;
+    readBlockRange(super, &src, 0, 1, block);
+    disk->readBlock(block[0], entries);
+    entries[1].inum = dstParentInodeNumber;
+    disk->writeBlock(block[0], entries);
   }
 
-  if (parent_inum >= 0 && parent_inum < super.num_inodes) {
-    inode_bitmap[parent_inum / 8] &= ~(1 << (parent_inum % 8));
+  // Free the source parent's emptied block and a replaced destination,
+  // writing the inodes before the bitmaps like unlink does
+  bool frees = blocks < (int) src_map.blocks.size() || dst_inum >= 0;
+  if (dst_inum >= 0) {
+    dropPending(dst_inum);
+  }
+  PagedBitmap inode_bitmap(disk, super->inode_bitmap_addr, super->num_inodes);
+  PagedBitmap data_bitmap(disk, super->data_bitmap_addr, super->num_data);
+  if (frees) {
+    pthread_mutex_lock(&inodeAllocatorLock);
+    pthread_mutex_lock(&dataAllocatorLock);
+    resizeBlockMap(super, src_map, data_bitmap, blocks);
+    if (dst_inum >= 0) {
+      BlockMap map;
+      readBlockMap(super, &dst, map);
+      resizeBlockMap(super, map, data_bitmap, 0);
+      inode_bitmap.clear(dst_inum);
+      memset(&dst, 0, sizeof(inode_t));
+    }
   }
 
-  inode.size -= sizeof(dir_ent_t);
-  inodeTable[parentInodeNumber] = inode;
-  inodeTable[parent_inum] = inode_from_lookup;
+  int count = 0;
+  int inode_numbers[4];
+  inode_t inodes[3];
+  writeBlockMap(super, src_parent, src_map, std::min(src_blocks, blocks));
+  inode_numbers[count] = srcParentInodeNumber;
+  inodes[count++] = *src_parent;
+  if (!same_parent) {
+    writeBlockMap(super, dst_parent, dst_map, dst_blocks);
+    inode_numbers[count] = dstParentInodeNumber;
+    inodes[count++] = *dst_parent;
+  }
+  if (dst_inum >= 0) {
+    inode_numbers[count] = dst_inum;
+    inodes[count++] = dst;
+  }
+  writeInodes(super, count, inode_numbers, inodes);
+  // a moved directory changed too, its .. is different
+  if (src.type == UFS_DIRECTORY && !same_parent) {
+    inode_numbers[count++] = src_inum;
+  }
+  touchInodes(super, count, inode_numbers);
 
-  writeInodeBitmap(&super, inode_bitmap);
-  writeInodeRegion(&super, inodeTable);
-  writeDataBitmap(&super, data_bitmap);
+  if (frees) {
+    writeInodeBitmap(super, inode_bitmap);
+    writeDataBitmap(super, data_bitmap);
+    pthread_mutex_unlock(&dataAllocatorLock);
+    pthread_mutex_unlock(&inodeAllocatorLock);
+  }
 
   return 0;
 }
+
+int LocalFileSystem::defragment(int inodeNumber) {
+  super_t super;
+  readSuperBlock(&super);
+
+  if (inodeNumber < 0 || inodeNumber >= super.num_inodes) {
+    return -EINVALIDINODE;
+  }
+
+  InodeLocks locks(this);
+  locks.lockExclusive(inodeNumber);
+  pthread_mutex_lock(&inodeAllocatorLock);
+  PagedBitmap inode_bitmap(disk, super.inode_bitmap_addr, super.num_inodes);
+  bool allocated = inode_bitmap.isSet(inodeNumber);
+  pthread_mutex_unlock(&inodeAllocatorLock);
+  if (!allocated) {
+    return -ENOTALLOCATED;
+  }
+
+  // buffered contents go to disk first, that's where they get laid out
+  inode_t inode;
+  readInode(&super, inodeNumber, &inode);
+  int ret = flushPending(&super, inodeNumber, &inode);
+  if (ret < 0) {
+    return ret;
+  }
+  BlockMap map;
+  readBlockMap(&super, &inode, map);
+
+  // Hashed directories keep their size when entries go, so lay the entries
+  // out again in the fewest blocks they fit in and free the rest. Flat
+  // directories are always packed, unlink closes the gaps.
+  if (inode.type == UFS_DIRECTORY && hashedDirectories(&super)) {
+    int blocks = map.blocks.size();
+    vector<dir_ent_t> dots, entries, layout;
+    readEntries(map, blocks, dots, entries);
+    sort(entries.begin(), entries.end(), hashOrder);
+    int packed = 1;
+    while (packed < blocks && !layoutHashed(dots, entries, packed, layout)) {
+      packed *= 2;
+    }
+    if (packed < blocks) {
+      for (int i = 0; i < packed; i++) {
+        if (!blockContains(map.blocks[i], &layout[i * Geometry::entriesPerBlock])) {
+          disk->writeBlock(map.blocks[i], &layout[i * Geometry::entriesPerBlock]);
+        }
+      }
+      inode.size = packed * UFS_BLOCK_SIZE;
+      pthread_mutex_lock(&dataAllocatorLock);
+      PagedBitmap data_bitmap(disk, super.data_bitmap_addr, super.num_data);
+      resizeBlockMap(&super, map, data_bitmap, packed);
+      writeBlockMap(&super, &inode, map, packed);
+      writeInode(&super, inodeNumber, &inode);
+      writeDataBitmap(&super, data_bitmap);
+      pthread_mutex_unlock(&dataAllocatorLock);
+    }
+  }
+
+  // The blocks in the order they should sit on disk: file order, with each
+  // indirect block right before the first block it points to, the same
+  // order resizeBlockMap allocates them in
+  vector<unsigned int> order;
+  int pointers = 0;
+  for (size_t i = 0; i < map.blocks.size(); i++) {
+    int needed = pointerBlocksNeeded(&super, i + 1);
+    while (pointers < needed) {
+      order.push_back(map.pointerBlocks[pointers++]);
+    }
+    order.push_back(map.blocks[i]);
+  }
+  int count = order.size();
+  if (count == 0) {
+    return 0;
+  }
+  bool contiguous = true;
+  for (int i = 1; i < count; i++) {
+    if (order[i] != order[0] + i) {
+      contiguous = false;
+    }
+  }
+
+  // Find the lowest run of free blocks that holds all of them. Files that
+  // are already in one piece only move down, which packs the data region
+  // toward its start. Files with blocks shared with other files stay put,
+  // moving them would undo the sharing.
+  bool dedup = dedupBlocks(&super);
+  pthread_mutex_lock(&dataAllocatorLock);
+  for (size_t i = 0; dedup && i < map.blocks.size(); i++) {
+    if (dedupTable[map.blocks[i] - super.data_region_addr].refs > 0) {
+      pthread_mutex_unlock(&dataAllocatorLock);
+      return 0;
+    }
+  }
+  PagedBitmap data_bitmap(disk, super.data_bitmap_addr, super.num_data);
+  int start = availableBlocks() < count ? -1 : data_bitmap.findClearRun(0, count);
+  if (start < 0 || (contiguous && (unsigned int) (super.data_region_addr + start) > order[0])) {
+    pthread_mutex_unlock(&dataAllocatorLock);
+    return contiguous ? 0 : -ENOTENOUGHSPACE;
+  }
+  for (int i = 0; i < count; i++) {
+    data_bitmap.set(start + i);
+  }
+  writeDataBitmap(&super, data_bitmap);
+  pthread_mutex_unlock(&dataAllocatorLock);
+
+  // copy the data over and point the inode at the copies
+  BlockMap new_map;
+  int next = super.data_region_addr + start;
+  pointers = 0;
+  for (size_t i = 0; i < map.blocks.size(); i++) {
+    int needed = pointerBlocksNeeded(&super, i + 1);
+    while (pointers < needed) {
+      new_map.pointerBlocks.push_back(next++);
+      pointers++;
+    }
+    char block[UFS_BLOCK_SIZE];
+    disk->readBlock(map.blocks[i], block);
+    disk->writeBlock(next, block);
+    new_map.blocks.push_back(next++);
+  }
+  writeBlockMap(&super, &inode, new_map);
+  writeInode(&super, inodeNumber, &inode);
+
+  // then give back the old blocks, the hashes of shared file data go with
+  // the contents
+  pthread_mutex_lock(&dataAllocatorLock);
+  PagedBitmap old_bitmap(disk, super.data_bitmap_addr, super.num_data);
+  for (size_t i = 0; i < map.blocks.size(); i++) {
+    unsigned int hash = dedup ? dedupTable[map.blocks[i] - super.data_region_addr].hash : 0;
+    freeDataBlock(&super, old_bitmap, map.blocks[i]);
+    if (hash != 0) {
+      indexBlock(&super, new_map.blocks[i], hash);
+    }
+  }
+  for (size_t i = 0; i < map.pointerBlocks.size(); i++) {
+    freeDataBlock(&super, old_bitmap, map.pointerBlocks[i]);
+  }
+  writeDataBitmap(&super, old_bitmap);
+  pthread_mutex_unlock(&dataAllocatorLock);
+
+  return count;
+}
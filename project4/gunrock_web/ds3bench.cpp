@@ -0,0 +1,279 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+
+#include <time.h>
+#include <unistd.h>
+
+#include "LocalFileSystem.h"
+#include "Disk.h"
+#include "ufs.h"
+
+using namespace std;
+
+// A name in the tree, found by looking up name in parent
+struct Entry {
+  int parent;
+  string name;
+  int inodeNumber;
+  int type;
+  int size;
+};
+
+// How long each call of one operation took, in nanoseconds
+struct Latencies {
+  string name;
+  vector<long> samples;
+};
+
+static long nanoseconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static double microseconds(vector<long> &sorted, double percentile) {
+  size_t idx = (size_t) (percentile / 100.0 * (sorted.size() - 1) + 0.5);
+  return sorted[idx] / 1000.0;
+}
+
+// Throughput counts only the time spent in the calls themselves
+static void report(Latencies &latencies) {
+  if (latencies.samples.empty()) {
+    return;
+  }
+  vector<long> sorted = latencies.samples;
+  sort(sorted.begin(), sorted.end());
+  double total = 0;
+  for (size_t idx = 0; idx < sorted.size(); idx++) {
+    total += sorted[idx];
+  }
+  cout << left << setw(7) << latencies.name << right
+       << setw(9) << sorted.size() << " ops"
+       << setw(10) << (long) (sorted.size() / (total / 1000000000.0)) << " ops/s"
+       << fixed << setprecision(1)
+       << "  p50 " << setw(8) << microseconds(sorted, 50)
+       << "  p90 " << setw(8) << microseconds(sorted, 90)
+       << "  p99 " << setw(8) << microseconds(sorted, 99)
+       << "  max " << setw(9) << sorted.back() / 1000.0 << " us" << endl;
+}
+
+// Every entry in the tree under root apart from . and ..
+static vector<Entry> walkTree(LocalFileSystem *fileSystem) {
+  vector<Entry> entries;
+  deque<int> directories;
+  directories.push_back(UFS_ROOT_DIRECTORY_INODE_NUMBER);
+  while (!directories.empty()) {
+    int directory = directories.front();
+    directories.pop_front();
+
+    vector<dir_ent_t> page;
+    long cookie = 0;
+    while (fileSystem->readdir(directory, page, Geometry::entriesPerBlock, cookie) > 0) {
+      for (size_t idx = 0; idx < page.size(); idx++) {
+        if (strcmp(page[idx].name, ".") == 0 || strcmp(page[idx].name, "..") == 0) {
+          continue;
+        }
+        inode_t inode;
+        if (fileSystem->stat(page[idx].inum, &inode) < 0) {
+          continue;
+        }
+        Entry entry = {directory, page[idx].name, page[idx].inum, inode.type, inode.size};
+        entries.push_back(entry);
+        if (inode.type == UFS_DIRECTORY) {
+          directories.push_back(page[idx].inum);
+        }
+      }
+    }
+  }
+  return entries;
+}
+
+int main(int argc, char *argv[]) {
+  int rounds = 10;
+  int numDirectories = 0;
+  int filesPerDirectory = 16;
+  int fileSize = 4096;
+  int width = 16;
+  bool keep = false;
+  bool badArgs = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:d:f:s:w:k")) != -1) {
+    switch (opt) {
+    case 'n':
+      rounds = atoi(optarg);
+      break;
+    case 'd':
+      numDirectories = atoi(optarg);
+      break;
+    case 'f':
+      filesPerDirectory = atoi(optarg);
+      break;
+    case 's':
+      fileSize = atoi(optarg);
+      break;
+    case 'w':
+      width = atoi(optarg);
+      break;
+    case 'k':
+      keep = true;
+      break;
+    default:
+      badArgs = true;
+    }
+  }
+  if (badArgs || optind != argc - 1 || rounds <= 0 || numDirectories < 0 ||
+      filesPerDirectory < 0 || fileSize < 0 || width <= 0) {
+    cerr << argv[0] << ": [-n rounds] [-d directories] [-f filesPerDirectory] [-s fileSize] [-w width] [-k] diskImageFile" << endl;
+    cerr << "For example:" << endl;
+    cerr << "    $ " << argv[0] << " -n 10 -d 64 -f 16 -s 4096 tests/disk_images/a.img" << endl;
+    return 1;
+  }
+
+  Disk *disk = new Disk(argv[optind], UFS_BLOCK_SIZE);
+  LocalFileSystem *fileSystem = new LocalFileSystem(disk);
+  Latencies mkdirs = {"mkdir"};
+  Latencies creates = {"create"};
+  Latencies writes = {"write"};
+  Latencies lookups = {"lookup"};
+  Latencies stats = {"stat"};
+  Latencies reads = {"read"};
+  Latencies unlinks = {"unlink"};
+
+  // Populate: the directories form a tree under ds3bench, width children
+  // each, and every one of them holds filesPerDirectory files
+  vector<Entry> created;
+  vector<int> directories;
+  if (numDirectories > 0) {
+    int top = fileSystem->create(UFS_ROOT_DIRECTORY_INODE_NUMBER, UFS_DIRECTORY, "ds3bench");
+    if (top < 0) {
+      cerr << "Error creating ds3bench, it may already exist" << endl;
+      return 1;
+    }
+    Entry entry = {UFS_ROOT_DIRECTORY_INODE_NUMBER, "ds3bench", top, UFS_DIRECTORY, 0};
+    created.push_back(entry);
+    directories.push_back(top);
+    vector<char> data(fileSize, 'x');
+    for (int dirIdx = 1; dirIdx <= numDirectories; dirIdx++) {
+      int parent = directories[(dirIdx - 1) / width];
+      string name = "d" + to_string(dirIdx);
+      long start = nanoseconds();
+      int directory = fileSystem->create(parent, UFS_DIRECTORY, name);
+      mkdirs.samples.push_back(nanoseconds() - start);
+      if (directory < 0) {
+        cerr << "Error creating directory " << name << ", out of space?" << endl;
+        return 1;
+      }
+      Entry entry = {parent, name, directory, UFS_DIRECTORY, 0};
+      created.push_back(entry);
+      directories.push_back(directory);
+
+      for (int fileIdx = 0; fileIdx < filesPerDirectory; fileIdx++) {
+        name = "f" + to_string(fileIdx);
+        start = nanoseconds();
+        int file = fileSystem->create(directory, UFS_REGULAR_FILE, name);
+        creates.samples.push_back(nanoseconds() - start);
+        if (file < 0) {
+          cerr << "Error creating file " << name << ", out of space?" << endl;
+          return 1;
+        }
+        start = nanoseconds();
+        int ret = fileSystem->write(file, data.data(), fileSize);
+        writes.samples.push_back(nanoseconds() - start);
+        if (ret != fileSize) {
+          cerr << "Error writing file " << name << ", out of space?" << endl;
+          return 1;
+        }
+        Entry entry = {directory, name, file, UFS_REGULAR_FILE, fileSize};
+        created.push_back(entry);
+      }
+    }
+  }
+
+  vector<Entry> entries = walkTree(fileSystem);
+  if (entries.empty()) {
+    cerr << "Nothing to look up, the image is empty" << endl;
+    return 1;
+  }
+  cout << entries.size() << " entries, " << rounds << " rounds" << endl;
+
+  for (int round = 0; round < rounds; round++) {
+    for (size_t idx = 0; idx < entries.size(); idx++) {
+      long start = nanoseconds();
+      int ret = fileSystem->lookup(entries[idx].parent, entries[idx].name);
+      lookups.samples.push_back(nanoseconds() - start);
+      if (ret != entries[idx].inodeNumber) {
+        cerr << "Lookup of " << entries[idx].name << " failed" << endl;
+        return 1;
+      }
+    }
+  }
+
+  for (int round = 0; round < rounds; round++) {
+    for (size_t idx = 0; idx < entries.size(); idx++) {
+      inode_t inode;
+      long start = nanoseconds();
+      int ret = fileSystem->stat(entries[idx].inodeNumber, &inode);
+      stats.samples.push_back(nanoseconds() - start);
+      if (ret < 0) {
+        cerr << "Stat of " << entries[idx].name << " failed" << endl;
+        return 1;
+      }
+    }
+  }
+
+  vector<char> buffer;
+  for (int round = 0; round < rounds; round++) {
+    for (size_t idx = 0; idx < entries.size(); idx++) {
+      if (entries[idx].type != UFS_REGULAR_FILE) {
+        continue;
+      }
+      buffer.resize(entries[idx].size + 1);
+      long start = nanoseconds();
+      int ret = fileSystem->read(entries[idx].inodeNumber, buffer.data(), entries[idx].size);
+      reads.samples.push_back(nanoseconds() - start);
+      if (ret != entries[idx].size) {
+        cerr << "Read of " << entries[idx].name << " failed" << endl;
+        return 1;
+      }
+    }
+  }
+
+  // Files first, then directories deepest first, only the files are timed
+  if (!keep) {
+    for (size_t idx = created.size(); idx > 0; idx--) {
+      Entry &entry = created[idx - 1];
+      if (entry.type != UFS_REGULAR_FILE) {
+        continue;
+      }
+      long start = nanoseconds();
+      int ret = fileSystem->unlink(entry.parent, entry.name);
+      unlinks.samples.push_back(nanoseconds() - start);
+      if (ret < 0) {
+        cerr << "Unlink of " << entry.name << " failed" << endl;
+        return 1;
+      }
+    }
+    for (size_t idx = created.size(); idx > 0; idx--) {
+      Entry &entry = created[idx - 1];
+      if (entry.type == UFS_DIRECTORY && fileSystem->unlink(entry.parent, entry.name) < 0) {
+        cerr << "Unlink of " << entry.name << " failed" << endl;
+        return 1;
+      }
+    }
+  }
+
+  report(mkdirs);
+  report(creates);
+  report(writes);
+  report(lookups);
+  report(stats);
+  report(reads);
+  report(unlinks);
+  return 0;
+}
@@ -1,7 +1,9 @@
 #include <iostream>
 #include <string>
+#include <vector>
 #include <algorithm>
 #include <cstring>
+#include <iomanip>
 
 #include "LocalFileSystem.h"
 #include "Disk.h"
@@ -25,8 +27,8 @@ int main(int argc, char *argv[]) {
 
   int inode_bytes = super.num_inodes / 8;
   int data_bytes = super.num_data / 8;
-  unsigned char inode_buffer[inode_bytes];
-  unsigned char data_buffer[data_bytes];
+  vector<unsigned char> inode_buffer(inode_bytes);
+  vector<unsigned char> data_buffer(data_bytes);
   
   // Super's stats
   std::cout << "Super" << std::endl;
@@ -39,7 +41,7 @@ int main(int argc, char *argv[]) {
   std::cout << std::endl;
 
   // Inode's stats
-  fileSystem->readInodeBitmap(&super, inode_buffer);
+  fileSystem->readInodeBitmap(&super, inode_buffer.data());
   std::cout << "Inode bitmap" << std::endl;
   for (int i = 0; i < inode_bytes; i++) {
     std::cout << (unsigned int) inode_buffer[i] << " ";
@@ -48,12 +50,24 @@ int main(int argc, char *argv[]) {
   std::cout << std::endl;
 
   // Data's stats
-  fileSystem->readDataBitmap(&super, data_buffer);
+  fileSystem->readDataBitmap(&super, data_buffer.data());
   std::cout << "Data bitmap" << std::endl;
   for (int i = 0; i < data_bytes; i++) {
     std::cout << (unsigned int) data_buffer[i] << " ";
   }
   std::cout << std::endl;
+
+  // how many file blocks each stored block stands in for
+  if (super.features & UFS_FEATURE_DEDUP) {
+    FileSystemStats stats;
+    fileSystem->statfs(&stats);
+    double ratio = stats.storedBlocks > 0 ? (double) stats.referencedBlocks / stats.storedBlocks : 1.0;
+    std::cout << std::endl;
+    std::cout << "Dedup" << std::endl;
+    std::cout << "stored_blocks " << stats.storedBlocks << std::endl;
+    std::cout << "referenced_blocks " << stats.referencedBlocks << std::endl;
+    std::cout << "dedup_ratio " << std::fixed << std::setprecision(2) << ratio << std::endl;
+  }
   
   return 0;
 }
@@ -39,24 +39,27 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
-  int blocks = inode.size / UFS_BLOCK_SIZE;
-  if ((inode.size % UFS_BLOCK_SIZE) != 0) {
-    blocks += 1;
-  }
+  super_t super;
+  fileSystem->readSuperBlock(&super);
+  BlockMap map;
+  fileSystem->readBlockMap(&super, &inode, map);
 
   std::cout << "File blocks" << std::endl;
-  for (int i = 0; i < blocks; i++) {
-    if (inode.direct[i] != 0) {
-      std::cout << inode.direct[i] << std::endl;
+  for (size_t i = 0; i < map.blocks.size(); i++) {
+    if (map.blocks[i] != 0) {
+      std::cout << map.blocks[i] << std::endl;
     }
   }
   std::cout << std::endl;
 
   std::cout << "File data" << std::endl;
-  for (int i = 0; i < blocks; i++) {
-    if (inode.direct[i] != 0) {
+  if (fileSystem->hasInlineData(&super, &inode)) {
+    write(STDOUT_FILENO, inode.direct, inode.size);
+  }
+  for (size_t i = 0; i < map.blocks.size(); i++) {
+    if (map.blocks[i] != 0) {
       int data = std::min(inode.size - bytes_left, UFS_BLOCK_SIZE);
-      disk->readBlock(inode.direct[i], buffer);
+      disk->readBlock(map.blocks[i], buffer);
       write(STDOUT_FILENO, buffer, data);
       bytes_left += data;
     }
@@ -1,8 +1,15 @@
 #include <iostream>
+#include <iomanip>
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
 
+#include <dirent.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <unistd.h>
@@ -13,27 +20,250 @@
 
 using namespace std;
 
+// -r commits a batch after this many files or bytes, whichever comes
+// first. Everything a batch writes stays in the undo log until then.
+#define BATCH_FILES (256)
+#define BATCH_BYTES (64 * 1024 * 1024)
+
+// What -r has committed so far, and the batch it is in the middle of
+struct Copy {
+  Disk *disk;
+  LocalFileSystem *fileSystem;
+  int batchFiles;
+  long batchDirectories;
+  long batchBytes;
+  int maxBatchFiles;
+  long files;
+  long directories;
+  long bytes;
+  bool failed;
+};
+
+static double now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// Streams a host file into inodeNumber a block at a time, in runs of up
+// to DELAYED_ALLOCATION_FILE_SIZE. With delayed allocation a file that
+// fits in one run gets all of its blocks when it's flushed. Returns the
+// number of bytes copied, or -1.
+static long copyContents(LocalFileSystem *fileSystem, string srcFile, int inodeNumber) {
+  int fd = open(srcFile.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  vector<char> run(DELAYED_ALLOCATION_FILE_SIZE);
+  long offset = 0;
+  bool done = false;
+  while (!done) {
+    int size = 0;
+    while (size < (int) run.size()) {
+      int ret = read(fd, run.data() + size, min(UFS_BLOCK_SIZE, (int) run.size() - size));
+      if (ret < 0) {
+        close(fd);
+        return -1;
+      } else if (ret == 0) {
+        done = true;
+        break;
+      }
+      size += ret;
+    }
+    if (offset + size > MAX_FILE_SIZE_INDIRECT) {
+      close(fd);
+      return -1;
+    }
+    // the first write replaces whatever the file had
+    int ret;
+    if (offset == 0) {
+      ret = fileSystem->write(inodeNumber, run.data(), size);
+    } else {
+      ret = size == 0 ? 0 : fileSystem->write(inodeNumber, run.data(), size, offset);
+    }
+    if (ret != size) {
+      close(fd);
+      return -1;
+    }
+    offset += size;
+  }
+  close(fd);
+  return offset;
+}
+
+// A batch is kept only if all of it made it to the image
+static bool commitBatch(Copy *copy) {
+  if (copy->failed || copy->fileSystem->sync() < 0) {
+    copy->disk->rollback();
+    return false;
+  }
+  copy->disk->commit();
+  copy->files += copy->batchFiles;
+  copy->directories += copy->batchDirectories;
+  copy->bytes += copy->batchBytes;
+  copy->batchFiles = 0;
+  copy->batchDirectories = 0;
+  copy->batchBytes = 0;
+  return true;
+}
+
+static void copyEntry(Copy *copy, string srcPath, int parentInode, string name) {
+  struct stat st;
+  if (lstat(srcPath.c_str(), &st) != 0) {
+    cerr << "Could not read " << srcPath << endl;
+    copy->failed = true;
+    return;
+  }
+  if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+    cerr << "Skipping " << srcPath << ", it isn't a file or a directory" << endl;
+    return;
+  }
+  if (name.size() >= DIR_ENT_NAME_SIZE) {
+    cerr << "Could not copy " << srcPath << ", names can be at most " << DIR_ENT_NAME_SIZE - 1
+         << " bytes" << endl;
+    copy->failed = true;
+    return;
+  }
+
+  // what's already in the image is reused, as long as it's the same type
+  int type = S_ISDIR(st.st_mode) ? UFS_DIRECTORY : UFS_REGULAR_FILE;
+  int inodeNumber = copy->fileSystem->lookup(parentInode, name);
+  inode_t inode;
+  if (inodeNumber >= 0 && (copy->fileSystem->stat(inodeNumber, &inode) < 0 || inode.type != type)) {
+    cerr << "Could not copy " << srcPath << ", the image has something else there" << endl;
+    copy->failed = true;
+    return;
+  } else if (inodeNumber < 0) {
+    inodeNumber = copy->fileSystem->create(parentInode, type, name);
+  }
+  if (inodeNumber < 0) {
+    cerr << "Could not create " << srcPath << " in the image" << endl;
+    copy->failed = true;
+    return;
+  }
+
+  if (type == UFS_REGULAR_FILE) {
+    long bytes = copyContents(copy->fileSystem, srcPath, inodeNumber);
+    if (bytes < 0) {
+      cerr << "Could not write " << srcPath << " to the image" << endl;
+      copy->failed = true;
+      return;
+    }
+    copy->batchFiles++;
+    copy->batchBytes += bytes;
+    if (copy->batchFiles >= copy->maxBatchFiles || copy->batchBytes >= BATCH_BYTES) {
+      if (!commitBatch(copy)) {
+        cerr << "Could not write " << srcPath << " to the image" << endl;
+        copy->failed = true;
+        return;
+      }
+      copy->disk->beginTransaction();
+    }
+    return;
+  }
+
+  copy->batchDirectories++;
+  DIR *dir = opendir(srcPath.c_str());
+  if (dir == NULL) {
+    cerr << "Could not read " << srcPath << endl;
+    copy->failed = true;
+    return;
+  }
+  vector<string> names;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+      names.push_back(entry->d_name);
+    }
+  }
+  closedir(dir);
+  sort(names.begin(), names.end());
+  for (size_t idx = 0; idx < names.size() && !copy->failed; idx++) {
+    copyEntry(copy, srcPath + "/" + names[idx], inodeNumber, names[idx]);
+  }
+}
+
+static string baseName(string path) {
+  while (path.size() > 1 && path[path.size() - 1] == '/') {
+    path.erase(path.size() - 1);
+  }
+  size_t slash = path.rfind('/');
+  return slash == string::npos ? path : path.substr(slash + 1);
+}
+
 int main(int argc, char *argv[]) {
-  if (argc != 4) {
+  bool recursive = false;
+  int maxBatchFiles = BATCH_FILES;
+  bool badArgs = false;
+  int option;
+  while ((option = getopt(argc, argv, "rb:")) != -1) {
+    if (option == 'r') {
+      recursive = true;
+    } else if (option == 'b') {
+      maxBatchFiles = atoi(optarg);
+    } else {
+      badArgs = true;
+    }
+  }
+  if (badArgs || maxBatchFiles <= 0 || (!recursive && argc - optind != 3) || (recursive && argc - optind < 3)) {
     cerr << argv[0] << ": diskImageFile src_file dst_inode" << endl;
+    cerr << argv[0] << ": -r [-b batchFiles] diskImageFile src... dst_directory_inode" << endl;
     cerr << "For example:" << endl;
     cerr << "    $ " << argv[0] << " tests/disk_images/a.img dthread.cpp 3" << endl;
+    cerr << "    $ " << argv[0] << " -r tests/disk_images/a.img include shared 0" << endl;
     return 1;
   }
 
   // Parse command line arguments
-  Disk *disk = new Disk(argv[1], UFS_BLOCK_SIZE);
+  Disk *disk = new Disk(argv[optind], UFS_BLOCK_SIZE);
   LocalFileSystem *fileSystem = new LocalFileSystem(disk);
-  string srcFile = string(argv[2]);
-  int dstInode = stoi(argv[3]);
+  int dstInode = atoi(argv[argc - 1]);
+  fileSystem->setDelayedAllocation(true);
 
-  // *****
+  if (!recursive) {
+    disk->beginTransaction();
+    // a copy that doesn't fit leaves the old file as it was
+    if (copyContents(fileSystem, argv[optind + 1], dstInode) < 0 || fileSystem->sync() < 0) {
+      disk->rollback();
+      std::cerr << "Could not write to dst_file" << std::endl;
+      return 1;
+    }
+    disk->commit();
+    return 0;
+  }
 
-  char buffer[MAX_FILE_SIZE];
-  if (fileSystem->write(dstInode, buffer, MAX_FILE_SIZE) < 0) {
-    std::cerr << "Could not write to dst_file" << std::endl;
+  inode_t inode;
+  if (fileSystem->stat(dstInode, &inode) < 0 || inode.type != UFS_DIRECTORY) {
+    cerr << "Could not copy into " << argv[argc - 1] << ", it isn't a directory" << endl;
     return 1;
   }
-  
-  return 0;
+
+  // Each batch is one transaction and so one fsync of the image
+  Copy copy;
+  copy.disk = disk;
+  copy.fileSystem = fileSystem;
+  copy.batchFiles = 0;
+  copy.batchDirectories = 0;
+  copy.batchBytes = 0;
+  copy.maxBatchFiles = maxBatchFiles;
+  copy.files = 0;
+  copy.directories = 0;
+  copy.bytes = 0;
+  copy.failed = false;
+  double start = now();
+  disk->beginTransaction();
+  for (int idx = optind + 1; idx < argc - 1 && !copy.failed; idx++) {
+    copyEntry(&copy, argv[idx], dstInode, baseName(argv[idx]));
+  }
+  // after an error the open batch is rolled back, only whole batches stay
+  if (!commitBatch(&copy) && !copy.failed) {
+    cerr << "Could not write the last files to the image" << endl;
+    copy.failed = true;
+  }
+  double seconds = now() - start;
+
+  cout << "copied " << copy.files << " files and " << copy.directories << " directories, "
+       << fixed << setprecision(1) << copy.bytes / (1024.0 * 1024.0) << " MB in " << seconds << " s, "
+       << (seconds > 0 ? copy.bytes / (1024.0 * 1024.0) / seconds : 0.0) << " MB/s" << endl;
+  return copy.failed ? 1 : 0;
 }
@@ -0,0 +1,98 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <cstring>
+
+#include "LocalFileSystem.h"
+#include "Disk.h"
+#include "ufs.h"
+
+using namespace std;
+
+// Every inode in the tree under root, each directory before its entries
+vector<int> walkTree(LocalFileSystem *fileSystem) {
+  vector<int> inodes;
+  deque<int> directories;
+  directories.push_back(UFS_ROOT_DIRECTORY_INODE_NUMBER);
+  inodes.push_back(UFS_ROOT_DIRECTORY_INODE_NUMBER);
+  while (!directories.empty()) {
+    int directory = directories.front();
+    directories.pop_front();
+
+    vector<dir_ent_t> page;
+    long cookie = 0;
+    while (fileSystem->readdir(directory, page, Geometry::entriesPerBlock, cookie) > 0) {
+      for (size_t idx = 0; idx < page.size(); idx++) {
+        if (strcmp(page[idx].name, ".") == 0 || strcmp(page[idx].name, "..") == 0) {
+          continue;
+        }
+        inode_t inode;
+        if (fileSystem->stat(page[idx].inum, &inode) < 0) {
+          continue;
+        }
+        inodes.push_back(page[idx].inum);
+        if (inode.type == UFS_DIRECTORY) {
+          directories.push_back(page[idx].inum);
+        }
+      }
+    }
+  }
+  return inodes;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    cerr << argv[0] << ": diskImageFile" << endl;
+    cerr << "For example:" << endl;
+    cerr << "    $ " << argv[0] << " tests/disk_images/a.img" << endl;
+    return 1;
+  }
+
+  Disk *disk = new Disk(argv[1], UFS_BLOCK_SIZE);
+  LocalFileSystem *fileSystem = new LocalFileSystem(disk);
+  FileSystemStats before;
+  fileSystem->statfs(&before);
+
+  // Moving one object can open up a run for another, so keep going until a
+  // pass moves nothing. Objects only ever move to lower runs once they are
+  // in one piece, so this ends. Each object is its own transaction.
+  vector<int> inodes = walkTree(fileSystem);
+  int fragmented = 0;
+  for (int pass = 1; ; pass++) {
+    int moved_blocks = 0;
+    int moved_objects = 0;
+    fragmented = 0;
+    for (size_t idx = 0; idx < inodes.size(); idx++) {
+      disk->beginTransaction();
+      int ret = fileSystem->defragment(inodes[idx]);
+      if (ret < 0 && ret != -ENOTENOUGHSPACE) {
+        disk->rollback();
+        fileSystem->loadStatistics();
+        cerr << "Error defragmenting inode " << inodes[idx] << endl;
+        return 1;
+      }
+      disk->commit();
+      if (ret == -ENOTENOUGHSPACE) {
+        fragmented++;
+      } else if (ret > 0) {
+        moved_blocks += ret;
+        moved_objects++;
+      }
+    }
+    if (moved_blocks == 0) {
+      break;
+    }
+    cout << "pass " << pass << ": moved " << moved_blocks << " blocks of "
+         << moved_objects << " objects" << endl;
+  }
+
+  FileSystemStats after;
+  fileSystem->statfs(&after);
+  cout << "freed " << after.freeBlocks - before.freeBlocks << " directory blocks" << endl;
+  if (fragmented > 0) {
+    cout << fragmented << " objects still fragmented, no free run was long enough" << endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,495 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+
+#include <pthread.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "LocalFileSystem.h"
+#include "Disk.h"
+#include "ufs.h"
+
+using namespace std;
+
+// What the phases find out about the image. Threads only ever write the
+// entries for their own inodes, so they don't need a lock.
+struct Image {
+  Disk *disk;
+  LocalFileSystem *fileSystem;
+  super_t super;
+  vector<unsigned char> inodeBitmap;
+  vector<unsigned char> dataBitmap;
+  // UFS_DIRECTORY or UFS_REGULAR_FILE for allocated inodes that look
+  // sane, -1 for the rest
+  vector<int> inodeTypes;
+  // the data region blocks each inode uses, indirect blocks included
+  vector<vector<unsigned int> > inodeBlocks;
+  vector<bool> reachable;
+};
+
+// One thread's share of a phase: the inode region blocks [first, last) to
+// scan, or directories to read along with their parents
+struct Work {
+  Image *image;
+  int first;
+  int last;
+  vector<pair<int, int> > directories;
+  // entries found in the directories, with the directory they are in
+  vector<pair<int, int> > found;
+  vector<string> problems;
+};
+
+static double now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+static void phaseDone(string name, double start, string details) {
+  cout << name << ": " << (long) (now() - start) << " ms";
+  if (details != "") {
+    cout << ", " << details;
+  }
+  cout << endl;
+}
+
+static bool isSet(vector<unsigned char> &bitmap, int bit) {
+  return (bitmap[bit / 8] & (1 << (bit % 8))) != 0;
+}
+
+static bool inDataRegion(super_t *super, unsigned int block) {
+  return block >= (unsigned int) super->data_region_addr &&
+    block < (unsigned int) (super->data_region_addr + super->num_data);
+}
+
+static void readRegion(Disk *disk, int address, int length, vector<unsigned char> &bytes) {
+  bytes.resize(length * UFS_BLOCK_SIZE);
+  for (int idx = 0; idx < length; idx++) {
+    disk->readBlock(address + idx, &bytes[idx * UFS_BLOCK_SIZE]);
+  }
+}
+
+// Everything else trusts the super block's layout, so it has to hold
+// together before we read anything else
+static void checkSuper(super_t *super, int diskBlocks, vector<string> &problems) {
+  int known = UFS_FEATURE_DIR_INDEX | UFS_FEATURE_INLINE_DATA | UFS_FEATURE_DEDUP | UFS_FEATURE_INODE_ATTRS;
+  if (super->version != UFS_VERSION_DIRECT && super->version != UFS_VERSION_INDIRECT) {
+    problems.push_back("unknown version " + to_string(super->version));
+  }
+  if ((super->features & ~known) != 0) {
+    problems.push_back("unknown features " + to_string(super->features & ~known));
+  }
+  if (super->num_inodes <= 0 || super->num_data <= 0) {
+    problems.push_back("no inodes or data blocks");
+    return;
+  }
+  if ((long) super->inode_bitmap_len * Geometry::bitsPerBlock < super->num_inodes ||
+      (long) super->data_bitmap_len * Geometry::bitsPerBlock < super->num_data) {
+    problems.push_back("a bitmap is too short for its region");
+  }
+  if ((long) super->inode_region_len * Geometry::inodesPerBlock < super->num_inodes ||
+      super->data_region_len < super->num_data) {
+    problems.push_back("a region is too short for its count");
+  }
+
+  // the regions follow each other in this order without overlapping
+  vector<pair<string, pair<int, int> > > regions;
+  regions.push_back(make_pair("inode bitmap", make_pair(super->inode_bitmap_addr, super->inode_bitmap_len)));
+  regions.push_back(make_pair("data bitmap", make_pair(super->data_bitmap_addr, super->data_bitmap_len)));
+  regions.push_back(make_pair("inode region", make_pair(super->inode_region_addr, super->inode_region_len)));
+  if (super->features & UFS_FEATURE_INODE_ATTRS) {
+    regions.push_back(make_pair("attr table", make_pair(super->attr_table_addr, super->attr_table_len)));
+    if ((long) super->attr_table_len * Geometry::attrsPerBlock < super->num_inodes) {
+      problems.push_back("attr table is too short");
+    }
+  }
+  if (super->features & UFS_FEATURE_DEDUP) {
+    regions.push_back(make_pair("dedup table", make_pair(super->dedup_table_addr, super->dedup_table_len)));
+    if ((long) super->dedup_table_len * Geometry::dedupEntriesPerBlock < super->num_data) {
+      problems.push_back("dedup table is too short");
+    }
+  }
+  regions.push_back(make_pair("data region", make_pair(super->data_region_addr, super->data_region_len)));
+  int next = 1;
+  for (size_t idx = 0; idx < regions.size(); idx++) {
+    int address = regions[idx].second.first;
+    int length = regions[idx].second.second;
+    if (address < next || length < 0 || (long) address + length > diskBlocks) {
+      problems.push_back(regions[idx].first + " is out of place");
+      return;
+    }
+    next = address + length;
+  }
+}
+
+// Checks one allocated inode and collects its blocks. The indirect blocks
+// are checked before readBlockMap follows them.
+static void checkInode(Image *image, int inodeNumber, inode_t *inode, vector<string> &problems) {
+  super_t *super = &image->super;
+  LocalFileSystem *fileSystem = image->fileSystem;
+  string name = "inode " + to_string(inodeNumber);
+  if (inode->type != UFS_DIRECTORY && inode->type != UFS_REGULAR_FILE) {
+    problems.push_back(name + " has unknown type " + to_string(inode->type));
+    return;
+  } else if (inode->size < 0 || inode->size > fileSystem->maxFileSize(super)) {
+    problems.push_back(name + " has bad size " + to_string(inode->size));
+    return;
+  } else if (inode->type == UFS_DIRECTORY && inode->size % sizeof(dir_ent_t) != 0) {
+    problems.push_back(name + " is a directory of " + to_string(inode->size) + " bytes");
+    return;
+  }
+
+  if (!fileSystem->hasInlineData(super, inode)) {
+    int blocks = (inode->size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+    int direct = fileSystem->numDirectPtrs(super);
+    vector<unsigned int> pointers;
+    if (blocks > direct) {
+      pointers.push_back(inode->direct[INDIRECT_PTR]);
+    }
+    if (blocks > direct + Geometry::pointersPerBlock) {
+      pointers.push_back(inode->direct[DOUBLE_INDIRECT_PTR]);
+      if (inDataRegion(super, inode->direct[DOUBLE_INDIRECT_PTR])) {
+        unsigned int double_pointers[Geometry::pointersPerBlock];
+        image->disk->readBlock(inode->direct[DOUBLE_INDIRECT_PTR], double_pointers);
+        int children = (blocks - direct - Geometry::pointersPerBlock + Geometry::pointersPerBlock - 1) / Geometry::pointersPerBlock;
+        pointers.insert(pointers.end(), double_pointers, double_pointers + children);
+      }
+    }
+    for (size_t idx = 0; idx < pointers.size(); idx++) {
+      if (!inDataRegion(super, pointers[idx])) {
+        problems.push_back(name + " has an indirect block outside the data region");
+        return;
+      }
+    }
+  }
+
+  BlockMap map;
+  fileSystem->readBlockMap(super, inode, map);
+  for (size_t idx = 0; idx < map.blocks.size(); idx++) {
+    if (!inDataRegion(super, map.blocks[idx])) {
+      problems.push_back(name + " has a block outside the data region");
+      return;
+    }
+  }
+  vector<unsigned int> &blocks = image->inodeBlocks[inodeNumber];
+  blocks.assign(map.pointerBlocks.begin(), map.pointerBlocks.end());
+  blocks.insert(blocks.end(), map.blocks.begin(), map.blocks.end());
+  image->inodeTypes[inodeNumber] = inode->type;
+}
+
+// Streams a range of the inode region a block at a time
+static void *scanInodes(void *arg) {
+  Work *work = static_cast<Work *>(arg);
+  Image *image = work->image;
+  inode_t inodes[Geometry::inodesPerBlock];
+  for (int block = work->first; block < work->last; block++) {
+    image->disk->readBlock(image->super.inode_region_addr + block, inodes);
+    for (int idx = 0; idx < Geometry::inodesPerBlock; idx++) {
+      int inodeNumber = block * Geometry::inodesPerBlock + idx;
+      if (inodeNumber >= image->super.num_inodes) {
+        break;
+      } else if (isSet(image->inodeBitmap, inodeNumber)) {
+        checkInode(image, inodeNumber, &inodes[idx], work->problems);
+      }
+    }
+  }
+  return NULL;
+}
+
+// Reads a share of one level of the tree. The entries it finds are sorted
+// out by the caller once every thread is done.
+static void *walkDirectories(void *arg) {
+  Work *work = static_cast<Work *>(arg);
+  Image *image = work->image;
+  for (size_t idx = 0; idx < work->directories.size(); idx++) {
+    int directory = work->directories[idx].first;
+    int parent = work->directories[idx].second;
+    string name = "directory " + to_string(directory);
+    bool dot = false;
+    bool dot_dot = false;
+
+    vector<dir_ent_t> page;
+    long cookie = 0;
+    while (image->fileSystem->readdir(directory, page, Geometry::entriesPerBlock, cookie) > 0) {
+      for (size_t entry = 0; entry < page.size(); entry++) {
+        int inodeNumber = page[entry].inum;
+        if (strcmp(page[entry].name, ".") == 0) {
+          dot = true;
+          if (inodeNumber != directory) {
+            work->problems.push_back(name + " has . pointing to " + to_string(inodeNumber));
+          }
+        } else if (strcmp(page[entry].name, "..") == 0) {
+          dot_dot = true;
+          if (inodeNumber != parent) {
+            work->problems.push_back(name + " has .. pointing to " + to_string(inodeNumber));
+          }
+        } else if (inodeNumber < 0 || inodeNumber >= image->super.num_inodes ||
+                   image->inodeTypes[inodeNumber] < 0) {
+          work->problems.push_back(name + " has " + page[entry].name + " pointing to bad inode " +
+                                   to_string(inodeNumber));
+        } else {
+          work->found.push_back(make_pair(inodeNumber, directory));
+        }
+      }
+    }
+    if (!dot || !dot_dot) {
+      work->problems.push_back(name + " is missing . or ..");
+    }
+  }
+  return NULL;
+}
+
+static void runThreads(vector<Work> &work, void *(*function)(void *)) {
+  vector<pthread_t> threads(work.size());
+  for (size_t idx = 0; idx < work.size(); idx++) {
+    pthread_create(&threads[idx], NULL, function, &work[idx]);
+  }
+  for (size_t idx = 0; idx < work.size(); idx++) {
+    pthread_join(threads[idx], NULL);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  bool repair = false;
+  int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int option;
+  while ((option = getopt(argc, argv, "rt:")) != -1) {
+    switch (option) {
+    case 'r':
+      repair = true;
+      break;
+    case 't':
+      num_threads = atoi(optarg);
+      break;
+    default:
+      optind = argc + 1;
+    }
+  }
+  if (optind != argc - 1 || num_threads < 1) {
+    cerr << argv[0] << ": [-r] [-t threads] diskImageFile" << endl;
+    cerr << "For example:" << endl;
+    cerr << "    $ " << argv[0] << " -r tests/disk_images/a.img" << endl;
+    return 1;
+  }
+
+  Image image;
+  image.disk = new Disk(argv[optind], UFS_BLOCK_SIZE);
+  super_t *super = &image.super;
+  vector<string> problems;
+
+  // Phase 1: the super block and the bitmaps it describes
+  double start = now();
+  char block[UFS_BLOCK_SIZE];
+  image.disk->readBlock(0, block);
+  memcpy(super, block, sizeof(super_t));
+  checkSuper(super, image.disk->numberOfBlocks(), problems);
+  if (!problems.empty()) {
+    for (size_t idx = 0; idx < problems.size(); idx++) {
+      cout << "super block: " << problems[idx] << endl;
+    }
+    return 1;
+  }
+  image.fileSystem = new LocalFileSystem(image.disk);
+  readRegion(image.disk, super->inode_bitmap_addr, super->inode_bitmap_len, image.inodeBitmap);
+  readRegion(image.disk, super->data_bitmap_addr, super->data_bitmap_len, image.dataBitmap);
+  vector<int> stray_inodes;
+  vector<int> stray_blocks;
+  for (int bit = super->num_inodes; bit < super->inode_bitmap_len * Geometry::bitsPerBlock; bit++) {
+    if (isSet(image.inodeBitmap, bit)) {
+      stray_inodes.push_back(bit);
+    }
+  }
+  for (int bit = super->num_data; bit < super->data_bitmap_len * Geometry::bitsPerBlock; bit++) {
+    if (isSet(image.dataBitmap, bit)) {
+      stray_blocks.push_back(bit);
+    }
+  }
+  phaseDone("phase 1, super block", start, "");
+
+  // Phase 2: every allocated inode, each thread streaming its own range of
+  // the inode region
+  start = now();
+  image.inodeTypes.assign(super->num_inodes, -1);
+  image.inodeBlocks.resize(super->num_inodes);
+  int inode_blocks = (super->num_inodes + Geometry::inodesPerBlock - 1) / Geometry::inodesPerBlock;
+  vector<Work> work(std::min(num_threads, inode_blocks));
+  for (size_t idx = 0; idx < work.size(); idx++) {
+    work[idx].image = &image;
+    work[idx].first = inode_blocks * idx / work.size();
+    work[idx].last = inode_blocks * (idx + 1) / work.size();
+  }
+  runThreads(work, scanInodes);
+  int allocated = 0;
+  for (int inodeNumber = 0; inodeNumber < super->num_inodes; inodeNumber++) {
+    allocated += isSet(image.inodeBitmap, inodeNumber) ? 1 : 0;
+  }
+  for (size_t idx = 0; idx < work.size(); idx++) {
+    problems.insert(problems.end(), work[idx].problems.begin(), work[idx].problems.end());
+  }
+  phaseDone("phase 2, inodes", start, to_string(allocated) + " allocated, " + to_string(work.size()) + " threads");
+
+  // Phase 3: the directory tree a level at a time, the directories of
+  // each level split between the threads
+  start = now();
+  image.reachable.assign(super->num_inodes, false);
+  if (image.inodeTypes[UFS_ROOT_DIRECTORY_INODE_NUMBER] != UFS_DIRECTORY) {
+    cout << "root directory is missing" << endl;
+    return 1;
+  }
+  image.reachable[UFS_ROOT_DIRECTORY_INODE_NUMBER] = true;
+  int reachable = 1;
+  vector<pair<int, int> > level(1, make_pair(UFS_ROOT_DIRECTORY_INODE_NUMBER, UFS_ROOT_DIRECTORY_INODE_NUMBER));
+  while (!level.empty()) {
+    work.assign(std::min((size_t) num_threads, level.size()), Work());
+    for (size_t idx = 0; idx < work.size(); idx++) {
+      work[idx].image = &image;
+      work[idx].directories.assign(level.begin() + level.size() * idx / work.size(),
+                                   level.begin() + level.size() * (idx + 1) / work.size());
+    }
+    runThreads(work, walkDirectories);
+
+    level.clear();
+    for (size_t idx = 0; idx < work.size(); idx++) {
+      problems.insert(problems.end(), work[idx].problems.begin(), work[idx].problems.end());
+      for (size_t entry = 0; entry < work[idx].found.size(); entry++) {
+        int inodeNumber = work[idx].found[entry].first;
+        if (image.reachable[inodeNumber]) {
+          problems.push_back("inode " + to_string(inodeNumber) + " is in more than one directory");
+          continue;
+        }
+        image.reachable[inodeNumber] = true;
+        reachable++;
+        if (image.inodeTypes[inodeNumber] == UFS_DIRECTORY) {
+          level.push_back(work[idx].found[entry]);
+        }
+      }
+    }
+  }
+  phaseDone("phase 3, directory tree", start, to_string(reachable) + " reachable");
+
+  // Phase 4: the bitmaps against what the tree uses
+  start = now();
+  bool dedup = (super->features & UFS_FEATURE_DEDUP) != 0;
+  vector<dedup_ent_t> dedup_table;
+  if (dedup) {
+    vector<unsigned char> bytes;
+    readRegion(image.disk, super->dedup_table_addr, super->dedup_table_len, bytes);
+    dedup_table.resize(bytes.size() / sizeof(dedup_ent_t));
+    memcpy(dedup_table.data(), bytes.data(), bytes.size());
+  }
+  vector<int> leaked_inodes;
+  vector<int> references(super->num_data, 0);
+  for (int inodeNumber = 0; inodeNumber < super->num_inodes; inodeNumber++) {
+    if (!image.reachable[inodeNumber]) {
+      if (isSet(image.inodeBitmap, inodeNumber)) {
+        leaked_inodes.push_back(inodeNumber);
+      }
+      continue;
+    }
+    vector<unsigned int> &blocks = image.inodeBlocks[inodeNumber];
+    for (size_t idx = 0; idx < blocks.size(); idx++) {
+      references[blocks[idx] - super->data_region_addr]++;
+    }
+  }
+  vector<int> leaked_blocks;
+  vector<int> missing_blocks;
+  vector<int> wrong_refs;
+  for (int bit = 0; bit < super->num_data; bit++) {
+    if (references[bit] == 0) {
+      if (isSet(image.dataBitmap, bit)) {
+        leaked_blocks.push_back(bit);
+      }
+      continue;
+    } else if (!isSet(image.dataBitmap, bit)) {
+      missing_blocks.push_back(bit);
+    }
+    if (dedup && dedup_table[bit].hash != 0) {
+      if ((int) dedup_table[bit].refs != references[bit] - 1) {
+        wrong_refs.push_back(bit);
+      }
+    } else if (references[bit] > 1) {
+      problems.push_back("block " + to_string(super->data_region_addr + bit) + " is used " +
+                         to_string(references[bit]) + " times");
+    }
+  }
+  phaseDone("phase 4, bitmaps", start, "");
+
+  for (size_t idx = 0; idx < problems.size(); idx++) {
+    cout << problems[idx] << endl;
+  }
+  stringstream fixable;
+  if (!leaked_inodes.empty()) {
+    fixable << leaked_inodes.size() << " leaked inodes" << endl;
+  }
+  if (!leaked_blocks.empty()) {
+    fixable << leaked_blocks.size() << " leaked blocks" << endl;
+  }
+  if (!missing_blocks.empty()) {
+    fixable << missing_blocks.size() << " blocks in use but free in the bitmap" << endl;
+  }
+  if (!wrong_refs.empty()) {
+    fixable << wrong_refs.size() << " blocks with the wrong dedup reference count" << endl;
+  }
+  if (!stray_inodes.empty() || !stray_blocks.empty()) {
+    fixable << stray_inodes.size() + stray_blocks.size() << " bits set past the end of a bitmap" << endl;
+  }
+  cout << fixable.str();
+  if (problems.empty() && fixable.str() == "") {
+    cout << "clean" << endl;
+    return 0;
+  } else if (!repair || fixable.str() == "") {
+    return 1;
+  }
+
+  // Phase 5: free what nothing uses and mark what the tree does use, all
+  // in one transaction
+  start = now();
+  Disk *disk = image.disk;
+  LocalFileSystem *fileSystem = image.fileSystem;
+  disk->beginTransaction();
+  PagedBitmap inode_bitmap(disk, super->inode_bitmap_addr, super->inode_bitmap_len * Geometry::bitsPerBlock);
+  PagedBitmap data_bitmap(disk, super->data_bitmap_addr, super->data_bitmap_len * Geometry::bitsPerBlock);
+  inode_t free_inode;
+  memset(&free_inode, 0, sizeof(inode_t));
+  for (size_t idx = 0; idx < leaked_inodes.size(); idx++) {
+    fileSystem->writeInode(super, leaked_inodes[idx], &free_inode);
+    inode_bitmap.clear(leaked_inodes[idx]);
+  }
+  for (size_t idx = 0; idx < stray_inodes.size(); idx++) {
+    inode_bitmap.clear(stray_inodes[idx]);
+  }
+  vector<bool> dedup_dirty(super->dedup_table_len, false);
+  for (size_t idx = 0; idx < leaked_blocks.size(); idx++) {
+    data_bitmap.clear(leaked_blocks[idx]);
+    if (dedup && (dedup_table[leaked_blocks[idx]].hash != 0 || dedup_table[leaked_blocks[idx]].refs != 0)) {
+      memset(&dedup_table[leaked_blocks[idx]], 0, sizeof(dedup_ent_t));
+      dedup_dirty[leaked_blocks[idx] / Geometry::dedupEntriesPerBlock] = true;
+    }
+  }
+  for (size_t idx = 0; idx < stray_blocks.size(); idx++) {
+    data_bitmap.clear(stray_blocks[idx]);
+  }
+  for (size_t idx = 0; idx < missing_blocks.size(); idx++) {
+    data_bitmap.set(missing_blocks[idx]);
+  }
+  for (size_t idx = 0; idx < wrong_refs.size(); idx++) {
+    dedup_table[wrong_refs[idx]].refs = references[wrong_refs[idx]] - 1;
+    dedup_dirty[wrong_refs[idx] / Geometry::dedupEntriesPerBlock] = true;
+  }
+  fileSystem->writeInodeBitmap(super, inode_bitmap);
+  fileSystem->writeDataBitmap(super, data_bitmap);
+  for (int idx = 0; idx < super->dedup_table_len; idx++) {
+    if (dedup_dirty[idx]) {
+      disk->writeBlock(super->dedup_table_addr + idx, &dedup_table[idx * Geometry::dedupEntriesPerBlock]);
+    }
+  }
+  disk->commit();
+  phaseDone("phase 5, repair", start, "");
+
+  // whatever is left couldn't be repaired
+  return problems.empty() ? 0 : 1;
+}
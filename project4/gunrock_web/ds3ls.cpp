@@ -1,11 +1,15 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <deque>
 #include <algorithm>
 #include <cstring>
 #include <sstream>
 #include <set>
 
+#include <pthread.h>
+#include <unistd.h>
+
 #include "StringUtils.h"
 #include "LocalFileSystem.h"
 #include "Disk.h"
@@ -19,10 +23,143 @@ bool compareByName(const dir_ent_t& a, const dir_ent_t& b) {
     return std::strcmp(a.name, b.name) < 0;
 }
 
+// -R: the directories still to be listed, shared by the workers. A
+// directory's entries are printed together, and its subdirectories are
+// queued as they turn up.
+struct TreeWalk {
+  LocalFileSystem *fileSystem;
+  bool sorted;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  std::deque<std::pair<int, std::string> > directories;
+  // workers in the middle of a directory, which may queue more
+  int busy;
+  bool failed;
+  pthread_mutex_t outputLock;
+};
+
+// Prints entries of the directory at path, one inum and full path a line,
+// and queues the subdirectories among them
+void printEntries(TreeWalk *walk, std::vector<dir_ent_t> &entries, std::string &path) {
+  std::string output;
+  std::vector<std::pair<int, std::string> > subdirectories;
+  for (size_t N = 0; N < entries.size(); N++) {
+    if (std::strcmp(entries[N].name, ".") == 0 || std::strcmp(entries[N].name, "..") == 0) {
+      continue;
+    }
+    std::string child = path + "/" + entries[N].name;
+    output += std::to_string(entries[N].inum) + "\t" + child + "\n";
+    inode_t inode;
+    if (walk->fileSystem->stat(entries[N].inum, &inode) == 0 && inode.type == UFS_DIRECTORY) {
+      subdirectories.push_back(std::make_pair(entries[N].inum, child));
+    }
+  }
+
+  pthread_mutex_lock(&walk->outputLock);
+  std::cout << output;
+  pthread_mutex_unlock(&walk->outputLock);
+  if (!subdirectories.empty()) {
+    pthread_mutex_lock(&walk->lock);
+    walk->directories.insert(walk->directories.end(), subdirectories.begin(), subdirectories.end());
+    pthread_cond_broadcast(&walk->changed);
+    pthread_mutex_unlock(&walk->lock);
+  }
+}
+
+// Unsorted listings go out a page at a time, as they are read
+void listDirectory(TreeWalk *walk, int inodeNumber, std::string path) {
+  std::vector<dir_ent_t> entries;
+  std::vector<dir_ent_t> page;
+  long cookie = 0;
+  int ret;
+  while ((ret = walk->fileSystem->readdir(inodeNumber, page, Geometry::entriesPerBlock, cookie)) > 0) {
+    if (walk->sorted) {
+      entries.insert(entries.end(), page.begin(), page.end());
+    } else {
+      printEntries(walk, page, path);
+    }
+  }
+  if (ret < 0) {
+    pthread_mutex_lock(&walk->outputLock);
+    std::cerr << "Could not read directory " << (path.empty() ? "/" : path) << std::endl;
+    walk->failed = true;
+    pthread_mutex_unlock(&walk->outputLock);
+    return;
+  }
+  if (walk->sorted) {
+    std::sort(entries.begin(), entries.end(), compareByName);
+    printEntries(walk, entries, path);
+  }
+}
+
+void *listDirectories(void *arg) {
+  TreeWalk *walk = (TreeWalk *) arg;
+  pthread_mutex_lock(&walk->lock);
+  while (true) {
+    while (walk->directories.empty() && walk->busy > 0) {
+      pthread_cond_wait(&walk->changed, &walk->lock);
+    }
+    // nothing queued and nobody left to queue more
+    if (walk->directories.empty()) {
+      break;
+    }
+    std::pair<int, std::string> directory = walk->directories.front();
+    walk->directories.pop_front();
+    walk->busy++;
+    pthread_mutex_unlock(&walk->lock);
+
+    listDirectory(walk, directory.first, directory.second);
+
+    pthread_mutex_lock(&walk->lock);
+    walk->busy--;
+    pthread_cond_broadcast(&walk->changed);
+  }
+  pthread_mutex_unlock(&walk->lock);
+  return NULL;
+}
+
+bool listTree(LocalFileSystem *fileSystem, int inodeNumber, std::string path, bool sorted, int numThreads) {
+  TreeWalk walk;
+  walk.fileSystem = fileSystem;
+  walk.sorted = sorted;
+  pthread_mutex_init(&walk.lock, NULL);
+  pthread_cond_init(&walk.changed, NULL);
+  pthread_mutex_init(&walk.outputLock, NULL);
+  walk.busy = 0;
+  walk.failed = false;
+  walk.directories.push_back(std::make_pair(inodeNumber, path));
+
+  std::vector<pthread_t> threads(numThreads);
+  for (int N = 0; N < numThreads; N++) {
+    pthread_create(&threads[N], NULL, listDirectories, &walk);
+  }
+  for (int N = 0; N < numThreads; N++) {
+    pthread_join(threads[N], NULL);
+  }
+  std::cout << std::flush;
+  return !walk.failed;
+}
+
 
 int main(int argc, char *argv[]) {
-  if (argc != 3) {
-    cerr << argv[0] << ": diskImageFile directory" << endl;
+  bool recursive = false;
+  bool sorted = true;
+  int numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+  bool badArgs = false;
+  int option;
+  while ((option = getopt(argc, argv, "RUt:")) != -1) {
+    if (option == 'R') {
+      recursive = true;
+    } else if (option == 'U') {
+      sorted = false;
+    } else if (option == 't') {
+      numThreads = atoi(optarg);
+    } else {
+      badArgs = true;
+    }
+  }
+  if (badArgs || optind != argc - 2 || numThreads <= 0) {
+    cerr << argv[0] << ": [-R] [-U] [-t threads] diskImageFile directory" << endl;
     cerr << "For example:" << endl;
     cerr << "    $ " << argv[0] << " tests/disk_images/a.img /a/b" << endl;
     return 1;
@@ -30,9 +167,9 @@ int main(int argc, char *argv[]) {
 
   // parse command line arguments
   
-  Disk *disk = new Disk(argv[1], UFS_BLOCK_SIZE);
+  Disk *disk = new Disk(argv[optind], UFS_BLOCK_SIZE);
   LocalFileSystem *fileSystem = new LocalFileSystem(disk);
-  string directory = string(argv[2]);
+  string directory = string(argv[optind + 1]);
 
   // Default to root for "/" case
   int local_inum = UFS_ROOT_DIRECTORY_INODE_NUMBER; 
@@ -67,31 +204,39 @@ int main(int argc, char *argv[]) {
 
   if (inode.type == UFS_REGULAR_FILE) {
     std::cout << local_inum << "\t" << dirs.back() << std::endl;
-  } else {
-    int blocks = inode.size / UFS_BLOCK_SIZE;
-    if ((inode.size % UFS_BLOCK_SIZE) != 0) {
-      blocks += 1;
+  } else if (recursive) {
+    std::string path;
+    for (size_t N = 0; N < dirs.size(); N++) {
+      path += "/" + dirs[N];
     }
-    int size = inode.size;
-    for (int i = 0; i < blocks; i++) {   
-      if (inode.direct[0] != 0) {
-        char local_buffer[UFS_BLOCK_SIZE * blocks];
-        int bytes_read = fileSystem->read(local_inum, local_buffer, size);
-        if (bytes_read < 0) {
-          std::cerr << "Directory not found" << std::endl;
-          return 1;
-        }
-        size -= bytes_read;
-        
-        for (size_t N = 0; N < inode.size / sizeof(dir_ent_t); N++) {
-          dir_ent_t entry;
-          std::memcpy(&entry, &local_buffer[N * sizeof(dir_ent_t)], sizeof(dir_ent_t));
-          if (entry.name[0] != '\0') {
-            files_in_dir.push_back(entry);
-          }
-        }
+    return listTree(fileSystem, local_inum, path, sorted, numThreads) ? 0 : 1;
+  } else if (!sorted) {
+    // print each page as it is read, in the directory's own order
+    std::vector<dir_ent_t> page;
+    long cookie = 0;
+    int ret;
+    while ((ret = fileSystem->readdir(local_inum, page, Geometry::entriesPerBlock, cookie)) > 0) {
+      for (size_t N = 0; N < page.size(); N++) {
+        std::cout << page[N].inum << "\t" << page[N].name << "\n";
       }
     }
+    std::cout << std::flush;
+    if (ret < 0) {
+      std::cerr << "Directory not found" << std::endl;
+      return 1;
+    }
+  } else {
+    // read the directory a block's worth of entries at a time
+    std::vector<dir_ent_t> page;
+    long cookie = 0;
+    int ret;
+    while ((ret = fileSystem->readdir(local_inum, page, Geometry::entriesPerBlock, cookie)) > 0) {
+      files_in_dir.insert(files_in_dir.end(), page.begin(), page.end());
+    }
+    if (ret < 0) {
+      std::cerr << "Directory not found" << std::endl;
+      return 1;
+    }
 
     std::sort(files_in_dir.begin(), files_in_dir.end(), compareByName);
     std::set<int> inums;
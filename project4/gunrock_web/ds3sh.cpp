@@ -0,0 +1,339 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+
+#include <unistd.h>
+
+#include "LocalFileSystem.h"
+#include "Disk.h"
+#include "ufs.h"
+
+using namespace std;
+
+// The file system stays mounted between commands, so the block cache and
+// the allocators' in memory state carry over from one command to the next
+struct Shell {
+  Disk *disk;
+  LocalFileSystem *fileSystem;
+  bool inTransaction;
+  // -b: commands since the last commit, and how many to batch together
+  int batched;
+  int batchSize;
+};
+
+static bool parseInode(string arg, int &inodeNumber) {
+  char *end;
+  long value = strtol(arg.c_str(), &end, 10);
+  if (arg.empty() || *end != '\0' || value < 0 || value > 0x7fffffff) {
+    return false;
+  }
+  inodeNumber = value;
+  return true;
+}
+
+static int lookupPath(LocalFileSystem *fileSystem, string path, string &last) {
+  int inodeNumber = UFS_ROOT_DIRECTORY_INODE_NUMBER;
+  stringstream parts(path);
+  string part;
+  while (getline(parts, part, '/')) {
+    if (part.empty()) {
+      continue;
+    }
+    inodeNumber = fileSystem->lookup(inodeNumber, part);
+    if (inodeNumber < 0) {
+      return inodeNumber;
+    }
+    last = part;
+  }
+  return inodeNumber;
+}
+
+static bool compareByName(const dir_ent_t &a, const dir_ent_t &b) {
+  return strcmp(a.name, b.name) < 0;
+}
+
+// the same output as ds3ls
+static bool listDirectory(Shell *shell, vector<string> &args) {
+  string last;
+  int inodeNumber = lookupPath(shell->fileSystem, args[1], last);
+  inode_t inode;
+  if (inodeNumber < 0 || shell->fileSystem->stat(inodeNumber, &inode) < 0) {
+    cerr << "Directory not found" << endl;
+    return false;
+  }
+  if (inode.type == UFS_REGULAR_FILE) {
+    cout << inodeNumber << "\t" << last << endl;
+    return true;
+  }
+
+  vector<dir_ent_t> entries;
+  vector<dir_ent_t> page;
+  long cookie = 0;
+  int ret;
+  while ((ret = shell->fileSystem->readdir(inodeNumber, page, Geometry::entriesPerBlock, cookie)) > 0) {
+    entries.insert(entries.end(), page.begin(), page.end());
+  }
+  if (ret < 0 || entries.empty()) {
+    cerr << "Directory not found" << endl;
+    return false;
+  }
+  sort(entries.begin(), entries.end(), compareByName);
+  set<int> inums;
+  for (size_t idx = 0; idx < entries.size(); idx++) {
+    string name = entries[idx].name;
+    if (name == "." || name == "..") {
+      cout << entries[idx].inum << "\t" << name << endl;
+    } else if (inums.insert(entries[idx].inum).second) {
+      cout << entries[idx].inum << "\t" << name << endl;
+    }
+  }
+  return true;
+}
+
+// the same output as ds3cat
+static bool catFile(Shell *shell, vector<string> &args) {
+  int inodeNumber;
+  inode_t inode;
+  if (!parseInode(args[1], inodeNumber) || shell->fileSystem->stat(inodeNumber, &inode) < 0 ||
+      inode.type != UFS_REGULAR_FILE) {
+    cerr << "Error reading file" << endl;
+    return false;
+  }
+  super_t super;
+  shell->fileSystem->readSuperBlock(&super);
+  BlockMap map;
+  shell->fileSystem->readBlockMap(&super, &inode, map);
+  cout << "File blocks" << endl;
+  for (size_t idx = 0; idx < map.blocks.size(); idx++) {
+    if (map.blocks[idx] != 0) {
+      cout << map.blocks[idx] << endl;
+    }
+  }
+  cout << endl;
+  cout << "File data" << endl;
+  vector<char> buffer(inode.size);
+  if (shell->fileSystem->read(inodeNumber, buffer.data(), inode.size) != inode.size) {
+    cerr << "Error reading file" << endl;
+    return false;
+  }
+  cout.write(buffer.data(), inode.size);
+  return true;
+}
+
+static bool createEntry(Shell *shell, vector<string> &args, int type) {
+  int parentInode;
+  if (!parseInode(args[1], parentInode) || shell->fileSystem->create(parentInode, type, args[2]) < 0) {
+    cerr << (type == UFS_DIRECTORY ? "Error creating directory" : "Error creating file") << endl;
+    return false;
+  }
+  return true;
+}
+
+static bool removeEntry(Shell *shell, vector<string> &args) {
+  int parentInode;
+  if (!parseInode(args[1], parentInode) || shell->fileSystem->unlink(parentInode, args[2]) < 0) {
+    cerr << "Error removing entry" << endl;
+    return false;
+  }
+  return true;
+}
+
+static bool renameEntry(Shell *shell, vector<string> &args) {
+  int srcParentInode;
+  int dstParentInode;
+  if (!parseInode(args[1], srcParentInode) || !parseInode(args[3], dstParentInode) ||
+      shell->fileSystem->rename(srcParentInode, args[2], dstParentInode, args[4]) < 0) {
+    cerr << "Error renaming entry" << endl;
+    return false;
+  }
+  return true;
+}
+
+// copies a host file into an existing file, like ds3cp
+static bool copyFile(Shell *shell, vector<string> &args) {
+  ifstream source(args[1].c_str(), ios::binary);
+  if (!source) {
+    cerr << "Could not read " << args[1] << endl;
+    return false;
+  }
+  stringstream contents;
+  contents << source.rdbuf();
+  string data = contents.str();
+  int dstInode;
+  if (!parseInode(args[2], dstInode) ||
+      shell->fileSystem->write(dstInode, data.data(), data.size()) != (int) data.size()) {
+    cerr << "Could not write to dst_file" << endl;
+    return false;
+  }
+  return true;
+}
+
+static void begin(Shell *shell) {
+  shell->disk->beginTransaction();
+  shell->inTransaction = true;
+}
+
+static void commit(Shell *shell) {
+  shell->disk->commit();
+  shell->inTransaction = false;
+  shell->batched = 0;
+}
+
+static void rollback(Shell *shell) {
+  shell->disk->rollback();
+  shell->fileSystem->loadStatistics();
+  shell->inTransaction = false;
+  shell->batched = 0;
+}
+
+static void help() {
+  cout << "ls directory              list a directory, like ds3ls" << endl;
+  cout << "cat inodeNumber           print a file's blocks and data, like ds3cat" << endl;
+  cout << "mkdir parentInode name    make a directory, like ds3mkdir" << endl;
+  cout << "touch parentInode name    make a file, like ds3touch" << endl;
+  cout << "rm parentInode name       remove an entry, like ds3rm" << endl;
+  cout << "cp srcFile dstInode       copy a host file into a file, like ds3cp" << endl;
+  cout << "mv srcParent srcName dstParent dstName" << endl;
+  cout << "                          rename an entry, replacing dstName" << endl;
+  cout << "begin                     start a transaction" << endl;
+  cout << "commit                    commit the transaction" << endl;
+  cout << "rollback                  undo everything since begin" << endl;
+  cout << "quit                      commit anything batched and exit" << endl;
+}
+
+// Runs one command line, false if it failed
+static bool run(Shell *shell, vector<string> &args) {
+  string command = args[0];
+  size_t expected = 0;
+  if (command == "ls" || command == "cat") {
+    expected = 2;
+  } else if (command == "mkdir" || command == "touch" || command == "rm" || command == "cp") {
+    expected = 3;
+  } else if (command == "mv") {
+    expected = 5;
+  } else if (command == "begin" || command == "commit" || command == "rollback" || command == "help") {
+    expected = 1;
+  } else {
+    cerr << "Unknown command " << command << ", try help" << endl;
+    return false;
+  }
+  if (args.size() != expected) {
+    cerr << "Wrong number of arguments for " << command << ", try help" << endl;
+    return false;
+  }
+
+  if (command == "begin" || command == "commit" || command == "rollback") {
+    // batches and explicit transactions don't mix
+    if (shell->batchSize > 0) {
+      cerr << command << " can't be used with -b" << endl;
+      return false;
+    }
+    if ((command == "begin") == shell->inTransaction) {
+      cerr << (shell->inTransaction ? "Already in a transaction" : "Not in a transaction") << endl;
+      return false;
+    }
+    if (command == "begin") {
+      begin(shell);
+    } else if (command == "commit") {
+      commit(shell);
+    } else {
+      rollback(shell);
+    }
+    return true;
+  } else if (command == "help") {
+    help();
+    return true;
+  } else if (command == "ls") {
+    return listDirectory(shell, args);
+  } else if (command == "cat") {
+    return catFile(shell, args);
+  }
+
+  if (shell->batchSize > 0 && !shell->inTransaction) {
+    begin(shell);
+  }
+  bool ok;
+  if (command == "mkdir") {
+    ok = createEntry(shell, args, UFS_DIRECTORY);
+  } else if (command == "touch") {
+    ok = createEntry(shell, args, UFS_REGULAR_FILE);
+  } else if (command == "rm") {
+    ok = removeEntry(shell, args);
+  } else if (command == "mv") {
+    ok = renameEntry(shell, args);
+  } else {
+    ok = copyFile(shell, args);
+  }
+  if (shell->batchSize > 0 && ++shell->batched == shell->batchSize) {
+    commit(shell);
+  }
+  return ok;
+}
+
+int main(int argc, char *argv[]) {
+  int batchSize = 0;
+  bool badArgs = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "b:")) != -1) {
+    if (opt == 'b') {
+      batchSize = atoi(optarg);
+    } else {
+      badArgs = true;
+    }
+  }
+  if (badArgs || optind != argc - 1 || batchSize < 0) {
+    cerr << argv[0] << ": [-b batchSize] diskImageFile" << endl;
+    cerr << "For example:" << endl;
+    cerr << "    $ echo 'mkdir 0 a' | " << argv[0] << " -b 100 tests/disk_images/a.img" << endl;
+    return 1;
+  }
+
+  Shell shell;
+  shell.disk = new Disk(argv[optind], UFS_BLOCK_SIZE);
+  shell.fileSystem = new LocalFileSystem(shell.disk);
+  shell.inTransaction = false;
+  shell.batched = 0;
+  shell.batchSize = batchSize;
+
+  bool interactive = isatty(STDIN_FILENO);
+  int failed = 0;
+  string line;
+  while (true) {
+    if (interactive) {
+      cout << "ds3> " << flush;
+    }
+    if (!getline(cin, line)) {
+      break;
+    }
+    vector<string> args;
+    stringstream words(line);
+    string word;
+    while (words >> word) {
+      args.push_back(word);
+    }
+    if (args.empty() || args[0][0] == '#') {
+      continue;
+    }
+    if (args[0] == "quit" || args[0] == "exit") {
+      break;
+    }
+    if (!run(&shell, args)) {
+      failed++;
+    }
+  }
+
+  // a batch is committed at the end, an explicit transaction isn't
+  if (shell.inTransaction && shell.batchSize > 0) {
+    commit(&shell);
+  } else if (shell.inTransaction) {
+    cerr << "Rolling back the unfinished transaction" << endl;
+    rollback(&shell);
+  }
+  return failed > 0 ? 1 : 0;
+}
@@ -29,7 +29,15 @@ int BUFFER_SIZE = 1;
 string BASEDIR = "ds3";
 string SCHEDALG = "FIFO";
 string LOGFILE = "/dev/null";
-string DISKFILE = "disk.img";
+vector<string> DISKFILES;
+bool WRITE_BACK = false;
+
+// mutex as well as some conditional variables and deque for sockets
+// Deque for FIFO order
+pthread_mutex_t Thread_Mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t producer_cond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t consumer_cond = PTHREAD_COND_INITIALIZER;
+std::deque<MySocket *> socket_deque;
 
 vector<HttpService *> services;
 
@@ -110,7 +118,7 @@ void handle_request(MySocket *client) {
   payload << " RESPONSE " << response->getStatus() << " client: " << (void *) client;
   sync_print("write_response", payload.str());
   cout << payload.str() << endl;
-  client->write(response->response());
+  response->write(client);
     
   delete response;
   delete request;
@@ -122,12 +130,45 @@ void handle_request(MySocket *client) {
   delete client;
 }
 
+// Workers take accepted clients off the deque and handle them, the file
+// system does its own locking so ds3 requests run in parallel too
+void *consumer(void * arg) {
+  while (true) {
+    dthread_mutex_lock(&Thread_Mutex);
+    while (!socket_deque.size()) {
+      dthread_cond_wait(&producer_cond, &Thread_Mutex);
+    }
+    MySocket *req = socket_deque.front();
+    socket_deque.pop_front();
+    dthread_cond_signal(&consumer_cond);
+    dthread_mutex_unlock(&Thread_Mutex);
+    handle_request(req);
+  }
+}
+
+// Accepts clients and waits for room in the deque, which holds at most
+// BUFFER_SIZE of them
+void producer(MyServerSocket * server) {
+  while (true) {
+    sync_print("waiting_to_accept", "");
+    MySocket *client = server->accept();
+    sync_print("client_accepted", "");
+    dthread_mutex_lock(&Thread_Mutex);
+    while (static_cast<int>(socket_deque.size()) >= BUFFER_SIZE) {
+      dthread_cond_wait(&consumer_cond, &Thread_Mutex);
+    }
+    socket_deque.push_back(client);
+    dthread_cond_signal(&producer_cond);
+    dthread_mutex_unlock(&Thread_Mutex);
+  }
+}
+
 int main(int argc, char *argv[]) {
 
   signal(SIGPIPE, SIG_IGN);
   int option;
 
-  while ((option = getopt(argc, argv, "d:p:t:b:s:l:i:")) != -1) {
+  while ((option = getopt(argc, argv, "d:p:t:b:s:l:i:w")) != -1) {
     switch (option) {
     case 'd':
       BASEDIR = string(optarg);
@@ -148,31 +189,35 @@ int main(int argc, char *argv[]) {
       LOGFILE = string(optarg);
       break;
     case 'i':
-      DISKFILE = string(optarg);
+      DISKFILES.push_back(string(optarg));
+      break;
+    case 'w':
+      WRITE_BACK = true;
       break;
     default:
-      cerr<< "usage: " << argv[0] << " [-p port] [-t threads] [-b buffers] [-i diskFile]" << endl;
+      cerr<< "usage: " << argv[0] << " [-p port] [-t threads] [-b buffers] [-w] [-i diskFile]..." << endl;
       exit(1);
     }
   }
 
   set_log_file(LOGFILE);
+  if (DISKFILES.empty()) {
+    DISKFILES.push_back("disk.img");
+  }
 
   cout << "Lisening on port " << PORT << endl;
   
   sync_print("init", "");
   MyServerSocket *server = new MyServerSocket(PORT);
-  MySocket *client;
 
   // The order that you push services dictates the search order
   // for path prefix matching
-  services.push_back(new DistributedFileSystemService(DISKFILE));
+  services.push_back(new DistributedFileSystemService(DISKFILES, WRITE_BACK));
   services.push_back(new FileService(BASEDIR));
-  
-  while(true) {
-    sync_print("waiting_to_accept", "");
-    client = server->accept();
-    sync_print("client_accepted", "");
-    handle_request(client);
+
+  pthread_t thread_list[THREAD_POOL_SIZE];
+  for (int i = 0; i < THREAD_POOL_SIZE; i++) {
+    dthread_create(&thread_list[i], NULL, consumer, NULL);
   }
+  producer(server);
 }
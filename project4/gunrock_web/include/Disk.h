@@ -3,6 +3,27 @@
 
 #include <string>
 #include <deque>
+#include <list>
+#include <map>
+#include <memory>
+
+#include <pthread.h>
+#include <sys/types.h>
+
+// How many blocks Disk keeps cached in memory
+#define DISK_CACHE_BLOCKS (1024)
+
+// Writes to blocks that share one of these locks take turns
+#define DISK_WRITE_LOCKS (64)
+
+// A reference counted, read-only copy of one disk block. Callers can keep
+// using a buffer after the cache evicts it or the block is rewritten.
+//
+// Disk is safe to use from several threads. Cache hits only take cacheLock
+// briefly, and neither misses nor writes hold it while they use the image.
+// There is only one transaction at a time, so callers that use them must
+// serialize their transactions themselves.
+typedef std::shared_ptr<const unsigned char> BlockBuffer;
 
 struct UndoRecord {
   int blockNumber;
@@ -16,16 +37,46 @@ class Disk {
   void writeBlock(int blockNumber, void *buffer);
   int numberOfBlocks();
 
+  // Returns the cached copy of a block, reading it in on a miss
+  BlockBuffer getBlock(int blockNumber);
+
   void beginTransaction();
   void commit();
   void rollback();
   
  private:
   std::string imageFile;
+  // kept open for as long as the Disk is around, read only if the image is
+  int imageFileDescriptor;
   int blockSize;
-  int imageFileSize;
+  off_t imageFileSize;
   bool isInTransaction;
   std::deque<struct UndoRecord> undoLog;
+
+  // reads straight from the image file, no locks needed
+  void readImage(int blockNumber, unsigned char *buffer);
+
+  // flushes everything written to the image, commit calls it once for the
+  // whole transaction instead of writeBlock fsyncing every block
+  void syncImage();
+
+  // A block's write lock is held across its whole write, so the image, the
+  // cache and the undo log see writes to a block in the same order. It's
+  // taken before cacheLock.
+  pthread_mutex_t writeLocks[DISK_WRITE_LOCKS];
+  pthread_mutex_t *writeLock(int blockNumber);
+
+  // LRU block cache, most recently used at the front of cacheOrder. All of
+  // the fields below are protected by cacheLock, and so are the transaction
+  // fields above. writeGenerations counts the writes to each block so that
+  // a miss doesn't cache data that a write replaced while it was reading.
+  pthread_mutex_t cacheLock;
+  std::map<int, unsigned long> writeGenerations;
+  unsigned long writeGeneration(int blockNumber);
+  BlockBuffer findCached(int blockNumber);
+  void cacheBlock(int blockNumber, BlockBuffer buffer);
+  std::list<int> cacheOrder;
+  std::map<int, std::pair<BlockBuffer, std::list<int>::iterator> > cache;
 };
 
 #endif
@@ -5,17 +5,60 @@
 #include "LocalFileSystem.h"
 
 #include <string>
+#include <vector>
+
+#include <pthread.h>
+
+// How often buffered objects are written out with write back on, see
+// LocalFileSystem::setDelayedAllocation
+#define FLUSH_INTERVAL_SECONDS (1)
+
+// One disk image and the file system on it. Every volume has its own
+// Disk, cache and locks, so requests for different volumes don't wait on
+// each other.
+struct Volume {
+  LocalFileSystem *fileSystem;
+
+  // Disk only has one transaction at a time, so PUTs, DELETEs and MOVEs on
+  // the same volume take turns. GETs don't take it and only wait on the
+  // file system's inode locks.
+  pthread_mutex_t transactionLock;
+};
 
 class DistributedFileSystemService : public HttpService {
  public:
   DistributedFileSystemService(std::string driveFile);
+  // Spreads the namespace over several disk images by top-level name, see
+  // volumeFor. The images have to be given in the same order every time.
+  // With writeBack a PUT returns once the object is buffered and the
+  // blocks are written in the background, and a crash loses whatever
+  // hasn't been written yet. Otherwise an object is on disk before its
+  // PUT returns.
+  DistributedFileSystemService(std::vector<std::string> driveFiles, bool writeBack = false);
 
   virtual void get(HTTPRequest *request, HTTPResponse *response);
   virtual void put(HTTPRequest *request, HTTPResponse *response);
   virtual void del(HTTPRequest *request, HTTPResponse *response);
+  virtual void move(HTTPRequest *request, HTTPResponse *response);
 
 private:
-  LocalFileSystem *fileSystem;
+  void mount(std::vector<std::string> driveFiles, bool writeBack);
+
+  // With write back on, writes out every volume's buffered objects every
+  // FLUSH_INTERVAL_SECONDS, each in its own transaction
+  static void *flushVolumes(void *service);
+
+  // The volume that holds everything under the top-level name, picked by
+  // its hash
+  Volume *volumeFor(std::string name);
+
+  // Walks the path components after /ds3/ and returns the inode number, or
+  // throws ClientError::notFound()
+  int lookupPath(Volume *volume, std::vector<std::string> path);
+
+  std::vector<Volume *> volumes;
+  bool writeBack;
+  pthread_t flusher;
 };
 
 #endif
@@ -2,7 +2,11 @@
 #define HTTP_RESPONSE_H_
 
 #include <map>
+#include <memory>
 #include <string>
+#include <vector>
+
+#include "MySocket.h"
 
 class HTTPResponse {
  public:
@@ -10,18 +14,26 @@ class HTTPResponse {
   void withStreaming();
   void setHeader(std::string name, std::string value);
   void setBody(std::string data);
+  // Adds body bytes that stay in a shared buffer, like a cached disk block,
+  // so write() can send them without copying them into the body string
+  void appendBody(std::shared_ptr<const unsigned char> buffer, int offset, int length);
   void setContentType(std::string contentType);
   void setStatus(int status);
   int getStatus();
   std::string response();
+  void write(MySocket *client);
 
  private:
   std::string statusToString();
+  std::string header();
 
   int status;
   bool streaming;
   std::map<std::string, std::string> headers;
   std::string body;
+  std::vector<std::shared_ptr<const unsigned char> > bodyBuffers;
+  std::vector<struct iovec> bodySegments;
+  size_t bodySegmentsSize;
   std::string contentType;
 };
 
@@ -2,6 +2,11 @@
 #define _LOCAL_FILE_SYSTEM_H_
 
 #include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+
+#include <pthread.h>
 
 #include "Disk.h"
 #include "ufs.h"
@@ -17,6 +22,20 @@
  * callers operate will not align on disk block boundaries, so your job is
  * to manage the interactions with the underlying storage to provide a higher
  * level of abstraction for any code that uses this class.
+ *
+ * All of the operations below can be called from several threads at once.
+ * Reads take a shared lock on the inode they read and writes take an
+ * exclusive one, so readers of the same file run in parallel. Locks are
+ * always taken in this order:
+ *
+ *   1. renameLock, only for renames between two directories
+ *   2. inode locks, in increasing lock index (create holds only the
+ *      parent's, unlink the parent's and the child's, rename up to four)
+ *   3. inodeAllocatorLock, for the inode bitmap and freeInodes
+ *   4. dataAllocatorLock, for the data bitmap, freeBlocks and the dedup
+ *      table and its counts
+ *   5. inodeTableLock, for updating an inode or its attributes in place
+ *   6. pendingLock, for the files buffered by delayed allocation
  */
 
 // Note: If a function invocation has more than one error, return
@@ -44,6 +63,111 @@
 // Unlinking '.' or '..'
 #define EUNLINKNOTALLOWED  (10)
 
+// The sizes that follow from the on-disk structures for a block size, all
+// compile time constants. Loops over the entries of a block get a fixed
+// trip count and arrays of them a fixed size, even in unoptimized builds.
+// A different BlockSize gives a different geometry next to this one, the
+// file system uses Geometry.
+template <int BlockSize>
+struct UfsGeometry {
+  static_assert(BlockSize % sizeof(inode_t) == 0 && BlockSize % sizeof(dir_ent_t) == 0,
+                "inodes and directory entries can't straddle blocks");
+  static constexpr int blockSize = BlockSize;
+  static constexpr int bitsPerBlock = BlockSize * 8;
+  static constexpr int inodesPerBlock = BlockSize / sizeof(inode_t);
+  static constexpr int entriesPerBlock = BlockSize / sizeof(dir_ent_t);
+  static constexpr int pointersPerBlock = BlockSize / sizeof(unsigned int);
+  static constexpr int attrsPerBlock = BlockSize / sizeof(inode_attr_t);
+  static constexpr int dedupEntriesPerBlock = BlockSize / sizeof(dedup_ent_t);
+};
+typedef UfsGeometry<UFS_BLOCK_SIZE> Geometry;
+static_assert(Geometry::pointersPerBlock == PTRS_PER_BLOCK, "ufs.h and Geometry disagree");
+
+// The disk block numbers of a file's data in file order, along with the
+// indirect blocks that hold them: the indirect block, then the double
+// indirect block, then each of the double indirect block's children.
+struct BlockMap {
+  std::vector<unsigned int> blocks;
+  std::vector<unsigned int> pointerBlocks;
+};
+
+// Part of a file that lives in a cached disk block, like a struct iovec
+// that also keeps its buffer alive.
+struct BlockSegment {
+  BlockBuffer block;
+  int offset;
+  int length;
+};
+
+// How full the file system is, see statfs. Blocks are data region blocks.
+struct FileSystemStats {
+  int blockSize;
+  int totalInodes;
+  int freeInodes;
+  int totalBlocks;
+  int freeBlocks;
+  // UFS_FEATURE_DEDUP only: file data blocks on disk and the file blocks
+  // they stand in for, so referencedBlocks / storedBlocks is how much
+  // deduplication saves
+  int storedBlocks;
+  int referencedBlocks;
+};
+
+// One of the on-disk bitmaps, read a block at a time through the disk cache
+// as its bits are used. Only the blocks it changes get a private copy, so
+// an operation holds a few blocks however large the image is. flush writes
+// the changed blocks back and returns how many more bits are set than
+// before.
+class PagedBitmap {
+ public:
+  PagedBitmap(Disk *disk, int address, int numBits);
+  bool isSet(int bit);
+  void set(int bit);
+  void clear(int bit);
+  // The lowest clear bit at or after start, or -1 if there isn't one
+  int findClear(int start);
+  // The first of the lowest length clear bits in a row at or after start,
+  // or -1 if there aren't that many together
+  int findClearRun(int start, int length);
+  int countSet();
+  // How many more bits are set than when the bitmap was last flushed
+  int added();
+  int flush();
+
+ private:
+  const unsigned char *page(int index);
+
+  Disk *disk;
+  int address;
+  int numBits;
+  BlockBuffer current;
+  int currentPage;
+  std::map<int, std::vector<unsigned char> > changed;
+  int setBits;
+};
+
+// Data blocks of regular files by content hash, see UFS_FEATURE_DEDUP
+typedef std::unordered_multimap<unsigned int, unsigned int> DedupIndex;
+
+// The contents of a file written with delayed allocation that aren't on
+// disk yet, see setDelayedAllocation. data is never changed once it's
+// buffered, a new write replaces it, so readv can hand it out.
+struct PendingFile {
+  BlockBuffer data;
+  int size;
+  // blocks of the free count promised to the file for when it's flushed
+  int reservedBlocks;
+};
+
+// Delayed allocation buffers at most this much of one file, larger writes
+// go straight to disk, and at most DELAYED_ALLOCATION_BUFFER_SIZE in all
+#define DELAYED_ALLOCATION_FILE_SIZE (1024 * 1024)
+#define DELAYED_ALLOCATION_BUFFER_SIZE (32 * 1024 * 1024)
+
+// Inodes share INODE_LOCKS reader-writer locks, inode n uses lock
+// n % INODE_LOCKS.
+#define INODE_LOCKS (64)
+
 class LocalFileSystem {
  public:
   LocalFileSystem(Disk *disk);
@@ -71,6 +195,20 @@ class LocalFileSystem {
    * Failure modes: invalid inodeNumber
    */
   int stat(int inodeNumber, inode_t *inode);
+
+  /**
+   * Read an inode's modification time and generation.
+   *
+   * Fills in attr from the attribute table, see UFS_FEATURE_INODE_ATTRS.
+   * The generation changes every time the inode does, so it is a cheap
+   * way to tell whether a file changed without reading it. Images without
+   * the table have both set to 0.
+   *
+   * Success: return 0
+   * Failure: return -EINVALIDINODE
+   * Failure modes: invalid inodeNumber
+   */
+  int getattr(int inodeNumber, inode_attr_t *attr);
   
   /**
    * Makes a file or directory.
@@ -91,7 +229,8 @@ class LocalFileSystem {
    * Write the contents of a file.
    *
    * Writes a buffer of size to the file, replacing any content that
-   * already exists.
+   * already exists. The file keeps its blocks and only the ones whose
+   * contents change are written.
    *
    * Success: number of bytes written
    * Failure: -EINVALIDINODE, -EINVALIDSIZE, -EINVALIDTYPE.
@@ -100,6 +239,22 @@ class LocalFileSystem {
    */
   int write(int inodeNumber, const void *buffer, int size);
 
+  /**
+   * Write part of a file.
+   *
+   * Writes a buffer of size to the file starting at byte offset, leaving
+   * the rest of the file as it is. Only the blocks covering the range are
+   * written. Writing past the end of the file grows it, and any gap
+   * between the old end and offset reads back as zeros.
+   *
+   * Success: number of bytes written, which is less than size if the disk
+   * ran out of space
+   * Failure: -EINVALIDINODE, -EINVALIDSIZE, -EINVALIDTYPE.
+   * Failure modes: invalid inodeNumber, invalid size or offset, not a
+   * regular file.
+   */
+  int write(int inodeNumber, const void *buffer, int size, int offset);
+
   /**
    * Read the contents of a file or directory.
    *
@@ -113,6 +268,50 @@ class LocalFileSystem {
    */
   int read(int inodeNumber, void *buffer, int size);
 
+  /**
+   * Read part of a file or directory.
+   *
+   * Reads up to `size` bytes starting at byte offset. Only the blocks
+   * covering the range are read. Reading at or past the end of the file
+   * returns 0.
+   *
+   * Success: number of bytes read
+   * Failure: -EINVALIDINODE, -EINVALIDSIZE.
+   * Failure modes: invalid inodeNumber, invalid size or offset.
+   */
+  int read(int inodeNumber, void *buffer, int size, int offset);
+
+  /**
+   * Read part of a file or directory without copying it.
+   *
+   * Same as read, but instead of copying data into a buffer it fills
+   * segments with references to the cached disk blocks that hold the
+   * range, in file order, so the caller can hand them to writev.
+   *
+   * Success: number of bytes covered by segments
+   * Failure: -EINVALIDINODE, -EINVALIDSIZE.
+   * Failure modes: invalid inodeNumber, invalid size or offset.
+   */
+  int readv(int inodeNumber, std::vector<BlockSegment> &segments, int size, int offset);
+
+  /**
+   * Read the entries of a directory a page at a time.
+   *
+   * Fills entries with up to count entries of the directory, skipping
+   * unused ones, in the order read() returns them. Only the blocks holding
+   * them are read. cookie says where to start, 0 for the beginning, and is
+   * set to where the next call should continue, so a listing can be read
+   * in pages without holding the whole directory. Cookies for hashed
+   * directories stay valid while entries are added and removed, a page
+   * can have a few more than count entries when their names hash the
+   * same.
+   *
+   * Success: number of entries, 0 once the whole directory has been read
+   * Failure: -EINVALIDINODE, -EINVALIDSIZE.
+   * Failure modes: invalid inodeNumber or not a directory, negative count.
+   */
+  int readdir(int inodeNumber, std::vector<dir_ent_t> &entries, int count, long &cookie);
+
   /**
    * Remove a file or directory.
    *
@@ -126,7 +325,110 @@ class LocalFileSystem {
    * existing is NOT a failure by our definition. You can't unlink '.' or '..'
    */
   int unlink(int parentInodeNumber, std::string name);
+
+  /**
+   * Rename a file or directory.
+   *
+   * Moves the entry srcName in srcParentInodeNumber to dstName in
+   * dstParentInodeNumber. Only directory entries change, the file's
+   * inode and data stay where they are. An existing dstName is replaced
+   * if it is the same type, and for directories, empty.
+   *
+   * Success: 0
+   * Failure: -EINVALIDINODE, -EINVALIDNAME, -ENOTFOUND, -EINVALIDTYPE,
+   * -EDIRNOTEMPTY, -ENOTENOUGHSPACE
+   * Failure modes: either parent does not exist or isn't a directory, a
+   * name is invalid or is . or .., srcName does not exist, dstName is a
+   * different type or a directory that is not empty, a directory would
+   * move inside itself (-EINVALIDINODE), or dstParentInodeNumber can't grow.
+   */
+  int rename(int srcParentInodeNumber, std::string srcName,
+             int dstParentInodeNumber, std::string dstName);
+
+  /**
+   * Move a file's or directory's blocks into one contiguous run.
+   *
+   * Copies the data and indirect blocks of inodeNumber, in file order with
+   * each indirect block ahead of the blocks it points to, into the lowest
+   * run of free blocks that holds them all, points the inode at the copies
+   * and frees the old blocks. Files already in one piece only move to a
+   * lower run, and files sharing blocks with others (UFS_FEATURE_DEDUP)
+   * stay where they are. Hashed directories are packed first, into the
+   * fewest blocks their entries fit in. Only the inode's own lock is held,
+   * so this can run while the file system is in use, and each call is
+   * small enough to make one Disk transaction.
+   *
+   * Success: number of blocks moved, 0 if nothing needed to move
+   * Failure: -EINVALIDINODE, -ENOTALLOCATED, -ENOTENOUGHSPACE.
+   * Failure modes: invalid inodeNumber, inodeNumber isn't in use, no free
+   * run is long enough for a fragmented file (a directory may still have
+   * been packed).
+   */
+  int defragment(int inodeNumber);
+
+  /**
+   * Buffer file contents in memory and allocate their blocks later.
+   *
+   * While it's on, write(inodeNumber, buffer, size) and writes to an
+   * already buffered file keep the new contents in memory instead of
+   * writing them, and only reserve the blocks they'll need out of the free
+   * count. The blocks are allocated when the file is flushed, all at once
+   * now that its size is known, so they can go in one run. A file that is
+   * removed before then never touches the data bitmap at all. Reads, stat
+   * and statfs see the buffered contents. Anything not flushed is lost if
+   * the process dies. Files over DELAYED_ALLOCATION_FILE_SIZE, writes that
+   * would buffer more than DELAYED_ALLOCATION_BUFFER_SIZE and images with
+   * UFS_FEATURE_DEDUP are written straight away. Off by default.
+   */
+  void setDelayedAllocation(bool enabled);
+
+  /**
+   * Write a buffered file to disk.
+   *
+   * Success: 0, also when the file has nothing buffered
+   * Failure: -EINVALIDINODE, -ENOTENOUGHSPACE.
+   * Failure modes: invalid inodeNumber, the disk ran out of space and only
+   * part of the file was written. The file stays buffered then, so a later
+   * flush can try again.
+   */
+  int flush(int inodeNumber);
+
+  /**
+   * Throw away a file's buffered contents without writing them, say after
+   * rolling back the transaction that created the file.
+   *
+   * Success: 0, also when the file has nothing buffered
+   * Failure: -EINVALIDINODE.
+   * Failure modes: invalid inodeNumber.
+   */
+  int discard(int inodeNumber);
+
+  /**
+   * Write every buffered file to disk, see flush.
+   *
+   * Success: number of files written
+   * Failure: -ENOTENOUGHSPACE, after writing as many as it could.
+   */
+  int sync();
   
+  /**
+   * File system usage.
+   *
+   * Fills in stats without touching the disk. The free counts are loaded
+   * from the bitmaps when the LocalFileSystem is made and kept up to date
+   * whenever it writes a bitmap, which also lets create and write give up
+   * early when the disk is full. Blocks reserved for buffered files, see
+   * setDelayedAllocation, don't count as free.
+   *
+   * Success: 0
+   */
+  int statfs(FileSystemStats *stats);
+
+  // Recounts the free inodes and blocks from the bitmaps and reloads the
+  // dedup table. Call it after they change behind the file system's back,
+  // like a Disk rollback.
+  void loadStatistics();
+
   /**
    * Some helper functions that you need to implement and use in your
    * implementation of the higher-level functions. When you operate on
@@ -135,18 +437,154 @@ class LocalFileSystem {
    */
   void readSuperBlock(super_t *super);
 
-  // Helper functions, you should read/write the entire inode and bitmap regions
+  // Helper functions, you should read/write the entire inode and bitmap regions.
+  // The write helpers take the whole region but only write back the blocks
+  // that differ from what is on disk, so small changes stay small. Callers
+  // of the bitmap writers hold that bitmap's allocator lock, and
+  // writeDataBitmap also writes back the dedup table. The file system
+  // itself uses the PagedBitmap versions, which don't need the whole
+  // bitmap in memory.
   void readInodeBitmap(super_t *super, unsigned char *inodeBitmap);
   void writeInodeBitmap(super_t *super, unsigned char *inodeBitmap);
+  void writeInodeBitmap(super_t *super, PagedBitmap &inodeBitmap);
   void readDataBitmap(super_t *super, unsigned char *dataBitmap);
   void writeDataBitmap(super_t *super, unsigned char *dataBitmap);
+  void writeDataBitmap(super_t *super, PagedBitmap &dataBitmap);
   void readInodeRegion(super_t *super, inode_t *inodes);
   void writeInodeRegion(super_t *super, inode_t *inodes);
 
+  // Block map helpers that hide the differences between on-disk versions.
+  // readBlockMap reads each indirect block once, so walking a large file
+  // costs one extra read per Geometry::pointersPerBlock data blocks.
+  int numDirectPtrs(super_t *super);
+  // True if the file's contents are in inode->direct, see
+  // UFS_FEATURE_INLINE_DATA. Such files have an empty block map.
+  bool hasInlineData(super_t *super, inode_t *inode);
+  int maxFileSize(super_t *super);
+  int pointerBlocksNeeded(super_t *super, int numBlocks);
+  void readBlockMap(super_t *super, inode_t *inode, BlockMap &map);
+  // Only reads the indirect blocks that cover the range
+  void readBlockRange(super_t *super, inode_t *inode, int firstBlock, int numBlocks,
+                      std::vector<unsigned int> &blocks);
+  // Only rewrites the indirect blocks that cover blocks from fromBlock on
+  void writeBlockMap(super_t *super, inode_t *inode, BlockMap &map, int fromBlock = 0);
+  // Grows or shrinks the map to numBlocks, freeing blocks and allocating the
+  // lowest numbered free ones as needed. Returns the number of blocks in the
+  // map, which is less than numBlocks if the disk ran out of space. With
+  // contiguous the new blocks come from the lowest run that fits them all,
+  // if there is one.
+  int resizeBlockMap(super_t *super, BlockMap &map, PagedBitmap &dataBitmap, int numBlocks,
+                     bool contiguous = false);
+  // True if the block already holds these UFS_BLOCK_SIZE bytes, so writes can
+  // skip it. Reads come from the disk cache, which is much cheaper than a
+  // write, its fsync and its undo log entry.
+  bool blockContains(unsigned int blockNumber, const void *buffer);
+
+  // Single inode helpers. readInode only reads the block the inode lives in
+  // and writeInode updates it under inodeTableLock, so writers of different
+  // inodes in the same block don't undo each other's changes. writeInodes
+  // does the same for count inodes at once.
+  void readInode(super_t *super, int inodeNumber, inode_t *inode);
+  void writeInode(super_t *super, int inodeNumber, inode_t *inode);
+  void writeInodes(super_t *super, int count, int *inodeNumbers, inode_t *inodes);
+
+  // The lock that covers inodeNumber, see the lock order above
+  pthread_rwlock_t *inodeLock(int inodeNumber);
+
   // Normally we'd mark this as private but we expose it so that you can access
   // it in a function you add that is not part of the LocalFileSystem object but
   // can still access the disk.
   Disk *disk;
+
+ private:
+  // Directory helpers for both the flat and the hashed directory formats,
+  // the caller holds the directory's lock. findEntry looks name up and
+  // returns its inode number. blocksWithEntry returns how many blocks the
+  // directory needs once name is added, or -1 if it can't grow that far.
+  // addEntry writes the entry once map has that many blocks (it had
+  // oldBlocks before), and removeEntry removes it and returns how many
+  // blocks the directory still needs. Hashed directories never shrink.
+  bool hashedDirectories(super_t *super);
+  int findEntry(super_t *super, inode_t *directory, std::string name);
+  int blocksWithEntry(super_t *super, inode_t *directory, BlockMap &map, std::string name);
+  void addEntry(super_t *super, inode_t *directory, BlockMap &map, int oldBlocks,
+                std::string name, int inodeNumber);
+  int removeEntry(super_t *super, inode_t *directory, BlockMap &map, std::string name);
+  bool directoryIsEmpty(super_t *super, inode_t *directory);
+  // Points the existing entry name at inodeNumber in place
+  void replaceEntry(super_t *super, inode_t *directory, BlockMap &map, std::string name,
+                    int inodeNumber);
+  // rename once the names are checked and renameLock is held if needed
+  int renameEntry(super_t *super, int srcParentInodeNumber, std::string srcName,
+                  int dstParentInodeNumber, std::string dstName);
+  // UFS_FEATURE_INODE_ATTRS: sets the inodes' mtime to now and bumps their
+  // generations, under inodeTableLock. The caller holds their locks.
+  bool inodeAttrs(super_t *super);
+  void touchInodes(super_t *super, int count, int *inodeNumbers);
+  // Delayed allocation helpers. availableBlocks is the free count less
+  // what's reserved and what dataBitmap has allocated but not written yet,
+  // the caller holds dataAllocatorLock. blocksFor counts the data and
+  // indirect blocks a file of size bytes needs. bufferWrite buffers the
+  // whole new contents of a file and returns false if they can't be.
+  // findPending copies out a file's buffered contents, and the caller
+  // holds the file's lock for as long as it uses them. flushPending
+  // writes them out and dropPending throws them away, the caller holds
+  // the file's lock exclusively.
+  int availableBlocks(PagedBitmap *dataBitmap = NULL);
+  int blocksFor(super_t *super, int size);
+  bool bufferWrite(super_t *super, int inodeNumber, inode_t *inode, const char *contents, int size);
+  bool findPending(int inodeNumber, PendingFile &file);
+  int flushPending(super_t *super, int inodeNumber, inode_t *inode);
+  void dropPending(int inodeNumber);
+  // write once the file is locked, without touching its attributes. A
+  // flush of a buffered file also has reserved blocks of the free count
+  // to use and lays the new blocks out in one run.
+  int writeContents(super_t *super, int inodeNumber, inode_t *inode, const char *data, int size,
+                    bool flushing, int reserved);
+  // Reads the live entries in the first numBlocks blocks of map, with .
+  // and .. in dots and everything else in entries
+  void readEntries(BlockMap &map, int numBlocks, std::vector<dir_ent_t> &dots,
+                   std::vector<dir_ent_t> &entries);
+
+  // UFS_FEATURE_DEDUP helpers. storeBlock writes contents as block index of
+  // map, sharing a block that already has the same contents or copying a
+  // shared block instead of writing over it, and takes dataAllocatorLock
+  // itself. It returns false if a copy needed a block and there wasn't one.
+  // freeDataBlock drops a reference and only frees the block once there are
+  // none left. Its caller holds dataAllocatorLock and writes the dedup table
+  // back along with the data bitmap. indexBlock and unindexBlock add and
+  // remove a block's hash, and with the reference changes keep
+  // storedBlocks and referencedBlocks current.
+  bool dedupBlocks(super_t *super);
+  bool storeBlock(super_t *super, BlockMap &map, int index, const void *contents);
+  void freeDataBlock(super_t *super, PagedBitmap &dataBitmap, unsigned int blockNumber);
+  dedup_ent_t &dedupEntry(super_t *super, unsigned int blockNumber);
+  void indexBlock(super_t *super, unsigned int blockNumber, unsigned int hash);
+  void unindexBlock(super_t *super, unsigned int blockNumber);
+  void writeDedupTable(super_t *super);
+
+  pthread_mutex_t renameLock;
+  pthread_rwlock_t inodeLocks[INODE_LOCKS];
+  pthread_mutex_t inodeAllocatorLock;
+  pthread_mutex_t dataAllocatorLock;
+  pthread_mutex_t inodeTableLock;
+  pthread_mutex_t pendingLock;
+  int freeInodes;
+  int freeBlocks;
+  // Delayed allocation's buffered files and their total size. The blocks
+  // they reserve are counted in reservedBlocks, under dataAllocatorLock.
+  bool delayedAllocation;
+  std::map<int, PendingFile> pending;
+  long pendingBytes;
+  int reservedBlocks;
+  // The dedup table, which blocks of it changed since it was last written
+  // and the blocks with each content hash
+  std::vector<dedup_ent_t> dedupTable;
+  std::vector<bool> dedupDirty;
+  DedupIndex dedupIndex;
+  // statfs's dedup counts, built at mount
+  int storedBlocks;
+  int referencedBlocks;
 };  
 
 #endif
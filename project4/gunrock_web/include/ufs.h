@@ -12,12 +12,89 @@
 
 #define MAX_FILE_SIZE (DIRECT_PTRS * UFS_BLOCK_SIZE)
 
+// On-disk format versions, recorded in the super block. Version 0 images
+// only have direct pointers. Version 1 keeps inode_t the same size but uses
+// the last two direct[] slots as an indirect and a double indirect pointer.
+#define UFS_VERSION_DIRECT (0)
+#define UFS_VERSION_INDIRECT (1)
+
+#define INDIRECT_PTR (DIRECT_PTRS - 2)
+#define DOUBLE_INDIRECT_PTR (DIRECT_PTRS - 1)
+#define PTRS_PER_BLOCK ((int) (UFS_BLOCK_SIZE / sizeof(unsigned int)))
+
+// Indirect blocks can address more than this, but inode sizes are ints
+#define MAX_FILE_SIZE_INDIRECT (0x7fffffff)
+
+// Optional format features, set by mkfs -O and recorded in the super block.
+//
+// UFS_FEATURE_DIR_INDEX: directories are hash tables. A directory of 2^k
+// blocks keeps each entry in the block picked by the top k bits of the
+// 32-bit FNV-1a hash of its name, sorted by hash and then by name, with
+// "." and ".." first in block 0. Unused entries have an empty name and
+// inum -1, and the directory size is always a whole number of blocks. A
+// directory doubles when a block fills up, which keeps entries in the same
+// order, so reading a directory returns its entries in hash order.
+#define UFS_FEATURE_DIR_INDEX (0x1)
+
+// 32-bit FNV-1a of length bytes. Names are hashed without their '\0'.
+// mkfs, the file system and the server all hash with this one, images
+// depend on them agreeing.
+static inline unsigned int ufs_hash(const void *data, int length) {
+    const unsigned char *bytes = (const unsigned char *) data;
+    unsigned int hash = 2166136261u;
+    int i;
+    for (i = 0; i < length; i++)
+	hash = (hash ^ bytes[i]) * 16777619u;
+    return hash;
+}
+
+// UFS_FEATURE_INLINE_DATA: a regular file of at most UFS_INLINE_DATA_SIZE
+// bytes keeps its contents in the bytes of its direct[] array instead of
+// in data blocks, zero filled past the end of the file. A file switches
+// between inline data and blocks as its size crosses that limit.
+#define UFS_FEATURE_INLINE_DATA (0x2)
+#define UFS_INLINE_DATA_SIZE (DIRECT_PTRS * (int) sizeof(unsigned int))
+
+// UFS_FEATURE_DEDUP: data blocks of regular files with the same contents
+// are stored once. The dedup table, between the inode region and the data
+// region, has a dedup_ent_t for each data block: how many references the
+// block has beyond the first, and the 32-bit FNV-1a hash of its contents,
+// or 0 for blocks that aren't shared file data like directory and indirect
+// blocks. A block with other references is never written in place, writes
+// to it go to a copy instead.
+#define UFS_FEATURE_DEDUP (0x4)
+
+typedef struct {
+    unsigned int refs;  // references beyond the first
+    unsigned int hash;  // hash of the contents, 0 if the block isn't shared
+} dedup_ent_t;
+
+// The hash a block's contents are indexed by, never 0
+static inline unsigned int ufs_block_hash(const void *contents) {
+    unsigned int hash = ufs_hash(contents, UFS_BLOCK_SIZE);
+    return hash != 0 ? hash : 1;
+}
+
+// UFS_FEATURE_INODE_ATTRS: every inode has an inode_attr_t in the
+// attribute table, which follows the inode region. mtime is when the inode
+// last changed, in seconds since the epoch, and generation goes up by one
+// each time it does: writes to a file, entries added to or removed from a
+// directory, and creating or unlinking the inode itself. Generations are
+// never reset, so an inode number and a generation name one version of an
+// object even after the inode is freed and used again.
+#define UFS_FEATURE_INODE_ATTRS (0x8)
+
+typedef struct {
+    unsigned int mtime;       // seconds since the epoch
+    unsigned int generation;  // changes made to the inode so far
+} inode_attr_t;
+
 // Note: Bitmap indexes identify disk blocks relative to the start of a region.
 
 typedef struct {
     int type;   // UFS_DIRECTORY or UFS_REGULAR
     int size;   // bytes
-    unsigned int direct[DIRECT_PTRS];
+    unsigned int direct[DIRECT_PTRS]; // last two are indirect in UFS_VERSION_INDIRECT
 } inode_t;
 
 #define DIR_ENT_NAME_SIZE (28)
@@ -38,6 +115,12 @@ typedef struct __super {
     int data_region_len;   // in blocks
     int num_inodes;        // just the number of inodes
     int num_data;          // and data blocks...
+    int version;           // UFS_VERSION_DIRECT or UFS_VERSION_INDIRECT
+    int features;          // UFS_FEATURE_* flags
+    int dedup_table_addr;  // block address (in blocks), UFS_FEATURE_DEDUP only
+    int dedup_table_len;   // in blocks
+    int attr_table_addr;   // block address (in blocks), UFS_FEATURE_INODE_ATTRS only
+    int attr_table_len;    // in blocks
 } super_t;
 
 
@@ -1,25 +1,493 @@
 #include <assert.h>
+#include <dirent.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include "ufs.h"
 
 void usage() {
-    fprintf(stderr, "usage: mkfs -f <image_file> [-d <num_data_blocks] [-i <num_inodes>]\n");
+    fprintf(stderr, "usage: mkfs -f <image_file> [-d <num_data_blocks] [-i <num_inodes>] [-V <version>] [-O <feature>] [-r <host_dir>]\n");
+    fprintf(stderr, "features: dir_index inline_data dedup inode_attrs, -O can be repeated\n");
     exit(1);
 }
 
+// mkfs -r: the host tree, one node per inode. Nodes are numbered breadth
+// first, so the children of a directory are consecutive, and a node's
+// number is its inode number.
+typedef struct {
+    char *path;
+    char name[DIR_ENT_NAME_SIZE];
+    int type;
+    int size;
+    int parent;
+    int first_child;
+    int num_children;
+    unsigned int mtime;
+} node_t;
+
+static node_t *nodes;
+static int num_nodes;
+static int max_nodes;
+
+// the next free data block, relative to the data region
+static int next_data;
+
+// Data blocks go out through one buffer, a run of consecutive blocks at
+// a time
+#define WRITE_BUFFER_BLOCKS (256)
+static unsigned char write_buffer[WRITE_BUFFER_BLOCKS * UFS_BLOCK_SIZE];
+static int write_start;
+static int write_count;
+
+// dedup images only: the table, and the blocks with each hash in chains
+// of data bitmap indexes plus one, 0 ends a chain
+static dedup_ent_t *dedup_table;
+static int *dedup_heads;
+static int *dedup_next;
+static unsigned int dedup_mask;
+
+static void add_node(const char *path, const char *name, int parent, struct stat *st) {
+    if (num_nodes == max_nodes) {
+	max_nodes = max_nodes == 0 ? 1024 : max_nodes * 2;
+	nodes = realloc(nodes, max_nodes * sizeof(node_t));
+	if (nodes == NULL) {
+	    perror("realloc");
+	    exit(1);
+	}
+    }
+    node_t *node = &nodes[num_nodes++];
+    memset(node, 0, sizeof(node_t));
+    node->path = strdup(path);
+    strcpy(node->name, name);
+    node->type = S_ISDIR(st->st_mode) ? UFS_DIRECTORY : UFS_REGULAR_FILE;
+    node->size = node->type == UFS_REGULAR_FILE ? st->st_size : 0;
+    node->parent = parent;
+    node->mtime = st->st_mtime;
+}
+
+static int name_order(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+// Reads the whole host tree, directories a level at a time
+static void walk_tree(const char *host_dir, int max_inodes) {
+    struct stat st;
+    if (stat(host_dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+	fprintf(stderr, "%s is not a directory\n", host_dir);
+	exit(1);
+    }
+    add_node(host_dir, "", 0, &st);
+
+    int i;
+    for (i = 0; i < num_nodes; i++) {
+	if (nodes[i].type != UFS_DIRECTORY)
+	    continue;
+	DIR *dir = opendir(nodes[i].path);
+	if (dir == NULL) {
+	    perror(nodes[i].path);
+	    exit(1);
+	}
+	char **names = NULL;
+	int num_names = 0;
+	struct dirent *ent;
+	while ((ent = readdir(dir)) != NULL) {
+	    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+		continue;
+	    names = realloc(names, (num_names + 1) * sizeof(char *));
+	    names[num_names++] = strdup(ent->d_name);
+	}
+	closedir(dir);
+	qsort(names, num_names, sizeof(char *), name_order);
+
+	nodes[i].first_child = num_nodes;
+	int j;
+	for (j = 0; j < num_names; j++) {
+	    char path[PATH_MAX];
+	    snprintf(path, sizeof(path), "%s/%s", nodes[i].path, names[j]);
+	    if (lstat(path, &st) != 0) {
+		perror(path);
+		exit(1);
+	    }
+	    if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+		fprintf(stderr, "skipping %s, it isn't a file or a directory\n", path);
+	    } else if (strlen(names[j]) >= DIR_ENT_NAME_SIZE) {
+		fprintf(stderr, "%s: names can be at most %d bytes\n", path, DIR_ENT_NAME_SIZE - 1);
+		exit(1);
+	    } else if (S_ISREG(st.st_mode) && st.st_size > MAX_FILE_SIZE_INDIRECT) {
+		fprintf(stderr, "%s: files can be at most %d bytes\n", path, MAX_FILE_SIZE_INDIRECT);
+		exit(1);
+	    } else if (num_nodes == max_inodes) {
+		fprintf(stderr, "not enough inodes for %s, use a larger -i\n", nodes[0].path);
+		exit(1);
+	    } else {
+		add_node(path, names[j], i, &st);
+		nodes[i].num_children++;
+	    }
+	    free(names[j]);
+	}
+	free(names);
+    }
+}
+
+static void flush_blocks(int fd) {
+    ssize_t len = (ssize_t) write_count * UFS_BLOCK_SIZE;
+    if (write_count > 0 && pwrite(fd, write_buffer, len, (off_t) write_start * UFS_BLOCK_SIZE) != len) {
+	perror("write");
+	exit(1);
+    }
+    write_count = 0;
+}
+
+static void put_block(int fd, int block, const void *contents) {
+    if (write_count > 0 && (block != write_start + write_count || write_count == WRITE_BUFFER_BLOCKS))
+	flush_blocks(fd);
+    if (write_count == 0)
+	write_start = block;
+    memcpy(write_buffer + write_count * UFS_BLOCK_SIZE, contents, UFS_BLOCK_SIZE);
+    write_count++;
+}
+
+static int alloc_block(super_t *s, const char *path) {
+    if (next_data == s->num_data) {
+	fprintf(stderr, "not enough data blocks for %s, use a larger -d\n", path);
+	exit(1);
+    }
+    return s->data_region_addr + next_data++;
+}
+
+static int direct_ptrs(super_t *s) {
+    return s->version == UFS_VERSION_INDIRECT ? INDIRECT_PTR : DIRECT_PTRS;
+}
+
+// the indirect blocks a file of count blocks needs
+static int pointer_blocks(super_t *s, int count, const char *path) {
+    int direct = direct_ptrs(s);
+    if (count <= direct)
+	return 0;
+    if (s->version != UFS_VERSION_INDIRECT) {
+	fprintf(stderr, "%s is too large for a version %d image, use -V %d\n", path, s->version,
+		UFS_VERSION_INDIRECT);
+	exit(1);
+    }
+    count -= direct;
+    if (count <= PTRS_PER_BLOCK)
+	return 1;
+    count -= PTRS_PER_BLOCK;
+    return 2 + (count + PTRS_PER_BLOCK - 1) / PTRS_PER_BLOCK;
+}
+
+// Points inode at blocks through the indirect blocks in pointers, which
+// are written out here
+static void point_to(int fd, super_t *s, inode_t *inode, unsigned int *blocks, int count,
+		     unsigned int *pointers) {
+    int direct = direct_ptrs(s);
+    int i, j;
+    for (i = 0; i < DIRECT_PTRS; i++)
+	inode->direct[i] = (i < direct && i < count) ? blocks[i] : 0;
+    if (count <= direct)
+	return;
+
+    unsigned int block[PTRS_PER_BLOCK];
+    inode->direct[INDIRECT_PTR] = pointers[0];
+    for (i = 0; i < PTRS_PER_BLOCK; i++)
+	block[i] = direct + i < count ? blocks[direct + i] : 0;
+    put_block(fd, pointers[0], block);
+    int next = direct + PTRS_PER_BLOCK;
+    if (next >= count)
+	return;
+
+    unsigned int double_block[PTRS_PER_BLOCK];
+    memset(double_block, 0, sizeof(double_block));
+    for (i = 0; next < count; i++, next += PTRS_PER_BLOCK) {
+	double_block[i] = pointers[i + 2];
+	for (j = 0; j < PTRS_PER_BLOCK; j++)
+	    block[j] = next + j < count ? blocks[next + j] : 0;
+	put_block(fd, pointers[i + 2], block);
+    }
+    inode->direct[DOUBLE_INDIRECT_PTR] = pointers[1];
+    put_block(fd, pointers[1], double_block);
+}
+
+static unsigned int name_hash(const char *name) {
+    return ufs_hash(name, strlen(name));
+}
+
+static int hash_order(const void *a, const void *b) {
+    const dir_ent_t *entry_a = a;
+    const dir_ent_t *entry_b = b;
+    unsigned int hash_a = name_hash(entry_a->name);
+    unsigned int hash_b = name_hash(entry_b->name);
+    if (hash_a != hash_b)
+	return hash_a < hash_b ? -1 : 1;
+    return strcmp(entry_a->name, entry_b->name);
+}
+
+// Lays out the entries of a hashed directory over as few blocks as fit
+// them, returns how many
+static int layout_hashed(dir_ent_t *entries, int count, dir_ent_t **blocks) {
+    int per_block = UFS_BLOCK_SIZE / sizeof(dir_ent_t);
+    qsort(entries + 2, count - 2, sizeof(dir_ent_t), hash_order);
+    int num_blocks, bits;
+    for (num_blocks = 1, bits = 0; ; num_blocks *= 2, bits++) {
+	*blocks = realloc(*blocks, num_blocks * UFS_BLOCK_SIZE);
+	int *used = calloc(num_blocks, sizeof(int));
+	int i, fits = 1;
+	for (i = 0; i < num_blocks * per_block; i++) {
+	    memset(&(*blocks)[i], 0, sizeof(dir_ent_t));
+	    (*blocks)[i].inum = -1;
+	}
+	for (i = 0; i < count && fits; i++) {
+	    int bucket = (i < 2 || bits == 0) ? 0 : name_hash(entries[i].name) >> (32 - bits);
+	    if (used[bucket] == per_block)
+		fits = 0;
+	    else
+		(*blocks)[bucket * per_block + used[bucket]++] = entries[i];
+	}
+	free(used);
+	if (fits)
+	    return num_blocks;
+    }
+}
+
+static void write_directory(int fd, super_t *s, int number, inode_t *inode) {
+    node_t *node = &nodes[number];
+    int count = node->num_children + 2;
+    int per_block = UFS_BLOCK_SIZE / sizeof(dir_ent_t);
+    dir_ent_t *entries = calloc(count, sizeof(dir_ent_t));
+    strcpy(entries[0].name, ".");
+    entries[0].inum = number;
+    strcpy(entries[1].name, "..");
+    entries[1].inum = node->parent;
+    int i;
+    for (i = 2; i < count; i++) {
+	strcpy(entries[i].name, nodes[node->first_child + i - 2].name);
+	entries[i].inum = node->first_child + i - 2;
+    }
+
+    dir_ent_t *blocks = NULL;
+    int num_blocks;
+    if (s->features & UFS_FEATURE_DIR_INDEX) {
+	num_blocks = layout_hashed(entries, count, &blocks);
+	inode->size = num_blocks * UFS_BLOCK_SIZE;
+    } else {
+	num_blocks = (count + per_block - 1) / per_block;
+	blocks = malloc(num_blocks * UFS_BLOCK_SIZE);
+	for (i = 0; i < num_blocks * per_block; i++) {
+	    if (i < count) {
+		blocks[i] = entries[i];
+	    } else {
+		memset(&blocks[i], 0, sizeof(dir_ent_t));
+		blocks[i].inum = -1;
+	    }
+	}
+	inode->size = count * sizeof(dir_ent_t);
+    }
+    inode->type = UFS_DIRECTORY;
+
+    // the root directory keeps the first data block mkfs gave it
+    unsigned int *block_numbers = malloc(num_blocks * sizeof(unsigned int));
+    int num_pointers = pointer_blocks(s, num_blocks, node->path);
+    unsigned int *pointers = malloc((num_pointers + 1) * sizeof(unsigned int));
+    if (number == UFS_ROOT_DIRECTORY_INODE_NUMBER)
+	block_numbers[0] = s->data_region_addr;
+    for (i = 0; i < num_pointers; i++)
+	pointers[i] = alloc_block(s, node->path);
+    for (i = number == UFS_ROOT_DIRECTORY_INODE_NUMBER ? 1 : 0; i < num_blocks; i++)
+	block_numbers[i] = alloc_block(s, node->path);
+    for (i = 0; i < num_blocks; i++)
+	put_block(fd, block_numbers[i], &blocks[i * per_block]);
+    point_to(fd, s, inode, block_numbers, num_blocks, pointers);
+
+    free(pointers);
+    free(block_numbers);
+    free(blocks);
+    free(entries);
+}
+
+// A block with the same contents as contents, 0 if there isn't one
+static unsigned int find_copy(int fd, super_t *s, unsigned int hash, const unsigned char *contents) {
+    int index;
+    for (index = dedup_heads[hash & dedup_mask]; index != 0; index = dedup_next[index - 1]) {
+	if (dedup_table[index - 1].hash != hash)
+	    continue;
+	unsigned char copy[UFS_BLOCK_SIZE];
+	flush_blocks(fd);
+	if (pread(fd, copy, UFS_BLOCK_SIZE, (off_t) (s->data_region_addr + index - 1) * UFS_BLOCK_SIZE) != UFS_BLOCK_SIZE) {
+	    perror("read");
+	    exit(1);
+	}
+	if (memcmp(copy, contents, UFS_BLOCK_SIZE) == 0)
+	    return s->data_region_addr + index - 1;
+    }
+    return 0;
+}
+
+static void read_host(int host_fd, const char *path, unsigned char *buffer, int len) {
+    int done = 0;
+    while (done < len) {
+	int rc = read(host_fd, buffer + done, len - done);
+	if (rc <= 0) {
+	    fprintf(stderr, "%s changed while it was being read\n", path);
+	    exit(1);
+	}
+	done += rc;
+    }
+}
+
+static void write_file(int fd, super_t *s, int number, inode_t *inode) {
+    node_t *node = &nodes[number];
+    inode->type = UFS_REGULAR_FILE;
+    inode->size = node->size;
+
+    int host_fd = open(node->path, O_RDONLY);
+    if (host_fd < 0) {
+	perror(node->path);
+	exit(1);
+    }
+    unsigned char contents[UFS_BLOCK_SIZE];
+
+    // small files keep their contents in the inode
+    if ((s->features & UFS_FEATURE_INLINE_DATA) && node->size <= UFS_INLINE_DATA_SIZE) {
+	read_host(host_fd, node->path, contents, node->size);
+	memset(inode->direct, 0, sizeof(inode->direct));
+	memcpy(inode->direct, contents, node->size);
+	close(host_fd);
+	return;
+    }
+
+    // the indirect blocks come first, then the data, so a file is one run
+    // unless it shares blocks
+    int num_blocks = (node->size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+    int num_pointers = pointer_blocks(s, num_blocks, node->path);
+    unsigned int *pointers = malloc((num_pointers + 1) * sizeof(unsigned int));
+    unsigned int *block_numbers = malloc((num_blocks + 1) * sizeof(unsigned int));
+    int i;
+    for (i = 0; i < num_pointers; i++)
+	pointers[i] = alloc_block(s, node->path);
+    for (i = 0; i < num_blocks; i++) {
+	int len = node->size - i * UFS_BLOCK_SIZE;
+	if (len > UFS_BLOCK_SIZE)
+	    len = UFS_BLOCK_SIZE;
+	memset(contents, 0, UFS_BLOCK_SIZE);
+	read_host(host_fd, node->path, contents, len);
+
+	unsigned int block = 0;
+	unsigned int hash = 0;
+	if (dedup_table != NULL) {
+	    hash = ufs_block_hash(contents);
+	    block = find_copy(fd, s, hash, contents);
+	}
+	if (block != 0) {
+	    dedup_table[block - s->data_region_addr].refs++;
+	} else {
+	    block = alloc_block(s, node->path);
+	    put_block(fd, block, contents);
+	    if (dedup_table != NULL) {
+		int index = block - s->data_region_addr;
+		dedup_table[index].hash = hash;
+		dedup_next[index] = dedup_heads[hash & dedup_mask];
+		dedup_heads[hash & dedup_mask] = index + 1;
+	    }
+	}
+	block_numbers[i] = block;
+    }
+    close(host_fd);
+    point_to(fd, s, inode, block_numbers, num_blocks, pointers);
+
+    free(pointers);
+    free(block_numbers);
+}
+
+static void write_blocks(int fd, int addr, const void *contents, int num_blocks) {
+    ssize_t len = (ssize_t) num_blocks * UFS_BLOCK_SIZE;
+    if (pwrite(fd, contents, len, (off_t) addr * UFS_BLOCK_SIZE) != len) {
+	perror("write");
+	exit(1);
+    }
+}
+
+// sets the first num_set bits of the bitmap at addr
+static void write_bitmap(int fd, int addr, int num_set) {
+    int bits_per_block = 8 * UFS_BLOCK_SIZE;
+    int num_blocks = (num_set + bits_per_block - 1) / bits_per_block;
+    unsigned char *bits = calloc(num_blocks, UFS_BLOCK_SIZE);
+    int i;
+    for (i = 0; i < num_set; i++)
+	bits[i / 8] |= 1 << (i % 8);
+    write_blocks(fd, addr, bits, num_blocks);
+    free(bits);
+}
+
+// Copies the host tree under host_dir into the new image. Everything is
+// laid out in inode order, each directory's blocks and then each file's,
+// and the inode region, tables and bitmaps are written once at the end.
+static void populate(int fd, super_t *s, const char *host_dir) {
+    walk_tree(host_dir, s->num_inodes);
+
+    int inodes_per_block = UFS_BLOCK_SIZE / sizeof(inode_t);
+    int inode_blocks = (num_nodes + inodes_per_block - 1) / inodes_per_block;
+    inode_t *inodes = calloc(inode_blocks, UFS_BLOCK_SIZE);
+    int attrs_per_block = UFS_BLOCK_SIZE / sizeof(inode_attr_t);
+    int attr_blocks = (num_nodes + attrs_per_block - 1) / attrs_per_block;
+    inode_attr_t *attrs = calloc(attr_blocks, UFS_BLOCK_SIZE);
+    if (s->features & UFS_FEATURE_DEDUP) {
+	dedup_table = calloc(s->dedup_table_len, UFS_BLOCK_SIZE);
+	for (dedup_mask = 1; dedup_mask < (unsigned int) s->num_data; dedup_mask *= 2)
+	    ;
+	dedup_heads = calloc(dedup_mask, sizeof(int));
+	dedup_next = calloc(s->num_data, sizeof(int));
+	dedup_mask -= 1;
+    }
+    if (inodes == NULL || attrs == NULL || ((s->features & UFS_FEATURE_DEDUP) && dedup_next == NULL)) {
+	perror("calloc");
+	exit(1);
+    }
+
+    // data block 0 is already the root directory's
+    next_data = 1;
+    int i;
+    for (i = 0; i < num_nodes; i++) {
+	if (nodes[i].type == UFS_DIRECTORY)
+	    write_directory(fd, s, i, &inodes[i]);
+	else
+	    write_file(fd, s, i, &inodes[i]);
+	attrs[i].mtime = nodes[i].mtime;
+	attrs[i].generation = 1;
+    }
+    flush_blocks(fd);
+
+    write_blocks(fd, s->inode_region_addr, inodes, inode_blocks);
+    if (s->features & UFS_FEATURE_INODE_ATTRS)
+	write_blocks(fd, s->attr_table_addr, attrs, attr_blocks);
+    if (s->features & UFS_FEATURE_DEDUP) {
+	int dedup_per_block = UFS_BLOCK_SIZE / sizeof(dedup_ent_t);
+	write_blocks(fd, s->dedup_table_addr, dedup_table, (next_data + dedup_per_block - 1) / dedup_per_block);
+    }
+    write_bitmap(fd, s->inode_bitmap_addr, num_nodes);
+    write_bitmap(fd, s->data_bitmap_addr, next_data);
+    printf("populated from %s: %d inodes, %d data blocks\n", host_dir, num_nodes, next_data);
+
+    free(inodes);
+    free(attrs);
+}
+
 int main(int argc, char *argv[]) {
     int ch;
     char *image_file = NULL;
     int num_inodes = 32;
     int num_data = 32;
     int visual = 0;
+    int version = UFS_VERSION_DIRECT;
+    int features = 0;
+    char *host_dir = NULL;
 
-    while ((ch = getopt(argc, argv, "i:d:f:v")) != -1) {
+    while ((ch = getopt(argc, argv, "i:d:f:vV:O:r:")) != -1) {
 	switch (ch) {
 	case 'i':
 	    num_inodes = atoi(optarg);
@@ -33,6 +501,24 @@ int main(int argc, char *argv[]) {
 	case 'v':
 	    visual = 1;
 	    break;
+	case 'r':
+	    host_dir = optarg;
+	    break;
+	case 'V':
+	    version = atoi(optarg);
+	    break;
+	case 'O':
+	    if (strcmp(optarg, "dir_index") == 0)
+		features |= UFS_FEATURE_DIR_INDEX;
+	    else if (strcmp(optarg, "inline_data") == 0)
+		features |= UFS_FEATURE_INLINE_DATA;
+	    else if (strcmp(optarg, "dedup") == 0)
+		features |= UFS_FEATURE_DEDUP;
+	    else if (strcmp(optarg, "inode_attrs") == 0)
+		features |= UFS_FEATURE_INODE_ATTRS;
+	    else
+		usage();
+	    break;
 	default:
 	    usage();
 	}
@@ -42,15 +528,18 @@ int main(int argc, char *argv[]) {
 
     if (image_file == NULL)
 	usage();
-
-    unsigned char *empty_buffer;
-    empty_buffer = calloc(UFS_BLOCK_SIZE, 1);
-    if (empty_buffer == NULL) {
-	perror("calloc");
+    if (version != UFS_VERSION_DIRECT && version != UFS_VERSION_INDIRECT)
+	usage();
+    // hashed directories double in size, which needs indirect blocks
+    if ((features & UFS_FEATURE_DIR_INDEX) && version < UFS_VERSION_INDIRECT) {
+	fprintf(stderr, "dir_index needs -V %d\n", UFS_VERSION_INDIRECT);
 	exit(1);
     }
 
-    int fd = open(image_file, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int fd = open(image_file, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
     if (fd < 0) {
 	perror("open");
 	exit(1);
@@ -65,6 +554,8 @@ int main(int argc, char *argv[]) {
     // totals
     s.num_inodes = num_inodes;
     s.num_data = num_data;
+    s.version = version;
+    s.features = features;
 
     // inode bitmap
     int bits_per_block = (8 * UFS_BLOCK_SIZE); // remember, there are 8 bits per byte
@@ -87,11 +578,33 @@ int main(int argc, char *argv[]) {
     if (total_inode_bytes % UFS_BLOCK_SIZE != 0)
 	s.inode_region_len++;
 
+    // attribute table, an entry per inode
+    s.attr_table_addr = 0;
+    s.attr_table_len = 0;
+    if (features & UFS_FEATURE_INODE_ATTRS) {
+	int total_attr_bytes = num_inodes * sizeof(inode_attr_t);
+	s.attr_table_addr = s.inode_region_addr + s.inode_region_len;
+	s.attr_table_len = total_attr_bytes / UFS_BLOCK_SIZE;
+	if (total_attr_bytes % UFS_BLOCK_SIZE != 0)
+	    s.attr_table_len++;
+    }
+
+    // dedup table, an entry per data block
+    s.dedup_table_addr = 0;
+    s.dedup_table_len = 0;
+    if (features & UFS_FEATURE_DEDUP) {
+	int total_dedup_bytes = num_data * sizeof(dedup_ent_t);
+	s.dedup_table_addr = s.inode_region_addr + s.inode_region_len + s.attr_table_len;
+	s.dedup_table_len = total_dedup_bytes / UFS_BLOCK_SIZE;
+	if (total_dedup_bytes % UFS_BLOCK_SIZE != 0)
+	    s.dedup_table_len++;
+    }
+
     // data blocks
-    s.data_region_addr = s.inode_region_addr + s.inode_region_len;
+    s.data_region_addr = s.inode_region_addr + s.inode_region_len + s.attr_table_len + s.dedup_table_len;
     s.data_region_len = num_data;
 
-    int total_blocks = 1 + s.inode_bitmap_len + s.data_bitmap_len + s.inode_region_len + s.data_region_len;
+    int total_blocks = 1 + s.inode_bitmap_len + s.data_bitmap_len + s.inode_region_len + s.attr_table_len + s.dedup_table_len + s.data_region_len;
 
     // super block is the first block
     int rc = pwrite(fd, &s, sizeof(super_t), 0);
@@ -101,22 +614,31 @@ int main(int argc, char *argv[]) {
     }
 
     printf("total blocks        %d\n", total_blocks);
+    printf("  format version    %d\n", version);
+    printf("  features         %s%s%s%s%s\n",
+	   (features & UFS_FEATURE_DIR_INDEX) ? " dir_index" : "",
+	   (features & UFS_FEATURE_INLINE_DATA) ? " inline_data" : "",
+	   (features & UFS_FEATURE_DEDUP) ? " dedup" : "",
+	   (features & UFS_FEATURE_INODE_ATTRS) ? " inode_attrs" : "",
+	   features == 0 ? " none" : "");
     printf("  inodes            %d [size of each: %lu]\n", num_inodes, sizeof(inode_t));
     printf("  data blocks       %d\n", num_data);
     printf("layout details\n");
     printf("  inode bitmap address/len %d [%d]\n", s.inode_bitmap_addr, s.inode_bitmap_len);
     printf("  data bitmap address/len  %d [%d]\n", s.data_bitmap_addr, s.data_bitmap_len);
-
-    // first, zero out all the blocks
+    if (features & UFS_FEATURE_INODE_ATTRS)
+	printf("  attr table address/len   %d [%d]\n", s.attr_table_addr, s.attr_table_len);
+    if (features & UFS_FEATURE_DEDUP)
+	printf("  dedup table address/len  %d [%d]\n", s.dedup_table_addr, s.dedup_table_len);
+
+    // first, size the image: the file is empty, so every block reads as
+    // zeros without writing them and only the blocks below that must not
+    // be zero get written
     int i;
-    for (i = 1; i < total_blocks; i++) {
-        rc = pwrite(fd, empty_buffer, UFS_BLOCK_SIZE, i * UFS_BLOCK_SIZE);
-        if (rc != UFS_BLOCK_SIZE) {
-            perror("write");
-            exit(1);
-        }
+    if (ftruncate(fd, (off_t) total_blocks * UFS_BLOCK_SIZE) != 0) {
+	perror("ftruncate");
+	exit(1);
     }
-    free(empty_buffer);
 
     //
     // need to allocate first inode in inode bitmap
@@ -151,13 +673,33 @@ int main(int argc, char *argv[]) {
     inode_block itable;
     itable.inodes[0].type = UFS_DIRECTORY;
     itable.inodes[0].size = 2 * sizeof(dir_ent_t); // in bytes
+    if (features & UFS_FEATURE_DIR_INDEX)
+	itable.inodes[0].size = UFS_BLOCK_SIZE; // hashed directories are whole blocks
     itable.inodes[0].direct[0] = s.data_region_addr;
     for (i = 1; i < DIRECT_PTRS; i++)
 	itable.inodes[0].direct[i] = -1;
+    if (version == UFS_VERSION_INDIRECT) {
+	itable.inodes[0].direct[INDIRECT_PTR] = 0;
+	itable.inodes[0].direct[DOUBLE_INDIRECT_PTR] = 0;
+    }
 
     rc = pwrite(fd, &itable, UFS_BLOCK_SIZE, s.inode_region_addr * UFS_BLOCK_SIZE);
     assert(rc == UFS_BLOCK_SIZE);
 
+    // the root directory's attributes, its first version is now
+    if (features & UFS_FEATURE_INODE_ATTRS) {
+	typedef struct {
+	    inode_attr_t attrs[UFS_BLOCK_SIZE / sizeof(inode_attr_t)];
+	} attr_block_t;
+
+	attr_block_t atable;
+	memset(&atable, 0, sizeof(atable));
+	atable.attrs[0].mtime = time(NULL);
+	atable.attrs[0].generation = 1;
+	rc = pwrite(fd, &atable, UFS_BLOCK_SIZE, s.attr_table_addr * UFS_BLOCK_SIZE);
+	assert(rc == UFS_BLOCK_SIZE);
+    }
+
     // 
     // need to write out root directory contents to first data block
     // create a root directory, with nothing in it
@@ -169,6 +711,7 @@ int main(int argc, char *argv[]) {
     assert(sizeof(dir_ent_t) * 128 == UFS_BLOCK_SIZE);
 
     dir_block_t parent;
+    memset(&parent, 0, sizeof(parent));
     strcpy(parent.entries[0].name, ".");
     parent.entries[0].inum = 0;
 
@@ -178,9 +721,12 @@ int main(int argc, char *argv[]) {
     for (i = 2; i < 128; i++)
 	parent.entries[i].inum = -1;
 
-    rc = pwrite(fd, &parent, UFS_BLOCK_SIZE, s.data_region_addr * UFS_BLOCK_SIZE);
+    rc = pwrite(fd, &parent, UFS_BLOCK_SIZE, (off_t) s.data_region_addr * UFS_BLOCK_SIZE);
     assert(rc == UFS_BLOCK_SIZE);
 
+    if (host_dir != NULL)
+	populate(fd, &s, host_dir);
+
     if (visual) {
 	int i;
 	printf("\nVisualization of layout\n\n");
@@ -191,6 +737,10 @@ int main(int argc, char *argv[]) {
 	    printf("d");
 	for (i = 0; i < s.inode_region_len; i++)
 	    printf("I");
+	for (i = 0; i < s.attr_table_len; i++)
+	    printf("A");
+	for (i = 0; i < s.dedup_table_len; i++)
+	    printf("T");
 	for (i = 0; i < s.data_region_len; i++)
 	    printf("D");
 	printf("\n\n");
@@ -198,6 +748,10 @@ int main(int argc, char *argv[]) {
 
     (void) fsync(fd);
     (void) close(fd);
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("built in %.1f ms\n", (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0);
     
     return 0;
 }
@@ -5,7 +5,9 @@
 #include <string.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <limits.h>
 #include <string>
+#include <vector>
 
 #include <iostream>
 
@@ -80,6 +82,38 @@ void MySocket::write_bytes(const void *buffer, int len) {
     }
 }
 
+void MySocket::writev(const struct iovec *iov, int iovcnt) {
+    vector<struct iovec> remaining;
+    for (int idx = 0; idx < iovcnt; idx++) {
+        if (iov[idx].iov_len > 0) {
+            remaining.push_back(iov[idx]);
+        }
+    }
+
+    if (sockFd<0) {
+      throw SocketNotConnected();
+    }
+
+    size_t next = 0;
+    while (next < remaining.size()) {
+        int count = min((int) (remaining.size() - next), IOV_MAX);
+        ssize_t bytesWritten = ::writev(sockFd, &remaining[next], count);
+        if (bytesWritten <= 0) {
+          throw SocketWriteError();
+        }
+
+        // skip past the buffers that went out, then trim a partial one
+        while (next < remaining.size() && (size_t) bytesWritten >= remaining[next].iov_len) {
+            bytesWritten -= remaining[next].iov_len;
+            next++;
+        }
+        if (bytesWritten > 0) {
+            remaining[next].iov_base = (char *) remaining[next].iov_base + bytesWritten;
+            remaining[next].iov_len -= bytesWritten;
+        }
+    }
+}
+
 string MySocket::read() {
     char buffer[4096];
     if(sockFd<0) {
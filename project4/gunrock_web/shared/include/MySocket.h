@@ -4,6 +4,8 @@
 #include <stdexcept>
 #include <string>
 
+#include <sys/uio.h>
+
 class SocketNotConnected : public std::runtime_error {
  public:
   SocketNotConnected() : std::runtime_error("socket not connected") {}
@@ -51,6 +53,11 @@ class MySocket {
 
   virtual std::string read();
   virtual void write(std::string data);
+  /*
+   * writes all of the buffers in order, gathering them with writev so
+   * they don't need to be copied into one string first
+   */
+  virtual void writev(const struct iovec *iov, int iovcnt);
   virtual void close(void);
   
  protected:
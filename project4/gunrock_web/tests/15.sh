@@ -0,0 +1,10 @@
+#!/bin/bash
+set -o pipefail
+
+cp tests/disk_images/a.img tests-out/15.img
+
+# mark inode 4 and data block 4 in use without anything pointing at them
+printf '\x1f' | dd of=tests-out/15.img bs=1 seek=4096 conv=notrunc status=none
+printf '\x1f' | dd of=tests-out/15.img bs=1 seek=8192 conv=notrunc status=none
+
+./ds3fsck tests-out/15.img | grep -v '^phase'
@@ -0,0 +1,11 @@
+#!/bin/bash
+set -e
+set -o pipefail
+
+cp tests/disk_images/a.img tests-out/16.img
+printf '\x1f' | dd of=tests-out/16.img bs=1 seek=4096 conv=notrunc status=none
+printf '\x1f' | dd of=tests-out/16.img bs=1 seek=8192 conv=notrunc status=none
+
+./ds3fsck -r tests-out/16.img | grep -v '^phase'
+./ds3fsck tests-out/16.img | grep -v '^phase'
+./ds3bits tests-out/16.img
@@ -0,0 +1,37 @@
+#!/bin/bash
+set -o pipefail
+
+cp tests/disk_images/b.img tests-out/17.img
+
+# within a directory, across directories and over an existing file
+./ds3sh tests-out/17.img <<'END'
+mv 2 c.txt 2 e.txt
+ls /a/b
+mv 2 e.txt 1 e.txt
+ls /a
+ls /a/b
+mv 1 e.txt 2 d.txt
+ls /a/b
+cat 3
+END
+echo "ds3sh exited with $?"
+
+# a directory into its own subtree, a file over a directory, a directory
+# over one that isn't empty, a missing name and a removed directory all
+# fail and change nothing
+./ds3sh tests-out/17.img <<'END'
+mv 0 a 2 a
+mv 1 b 2 b
+mv 2 d.txt 1 b
+mkdir 0 x
+mv 0 x 1 b
+mv 2 missing 2 z
+mkdir 0 y
+rm 0 y
+mv 2 d.txt 5 d.txt
+ls /
+ls /a
+ls /a/b
+END
+echo "ds3sh exited with $?"
+./ds3fsck tests-out/17.img | grep -v '^phase'
@@ -0,0 +1,31 @@
+#!/bin/bash
+set -e
+
+cp tests/disk_images/a.img tests-out/18.img
+printf 'hello from the host\n' > tests-out/18.txt
+
+# rollback has to undo everything since begin, commit has to keep it
+./ds3sh tests-out/18.img <<'END'
+# build a small tree
+mkdir 0 d
+touch 4 f
+cp tests-out/18.txt 5
+ls /d
+cat 5
+begin
+mkdir 0 gone
+touch 4 g
+rm 4 f
+ls /d
+rollback
+ls /
+ls /d
+cat 5
+begin
+touch 4 h
+commit
+END
+
+# and what's on disk afterwards matches
+./ds3ls tests-out/18.img /d
+./ds3fsck tests-out/18.img | grep -v '^phase'